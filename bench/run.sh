@@ -0,0 +1,58 @@
+#!/bin/bash
+
+#Run the benchmark suite and report operations per second
+#
+#    bench/run.sh [interpreter]
+#
+#Each benchmark script ends with a (time {...}) form, whose result
+#{wall-microseconds cpu-microseconds allocations value} is the last line
+#it prints. The operation counts below match the work each script does.
+
+LISPY=${1:-./conditionals.exe}
+BENCH=$(dirname "$0")
+
+if [ ! -x "$LISPY" ]; then
+	echo "Interpreter '$LISPY' not found, build it first" >&2
+	exit 1
+fi
+
+printf "%-8s %10s %10s %10s %10s %12s\n" benchmark ops wall-ms cpu-ms allocs ops/sec
+
+#report name operations wall-usec cpu-usec allocations
+
+report() {
+	awk -v name=$1 -v ops=$2 -v wall=$3 -v cpu=$4 -v allocs=$5 'BEGIN {
+		printf "%-8s %10d %10.1f %10.1f %10s %12.0f\n", name, ops,
+			wall / 1000, cpu / 1000, allocs, (wall > 0) ? ops * 1000000 / wall : 0
+	}'
+}
+
+#name:script:operations
+for entry in fib:fib.lspy:57313 join:join.lspy:4000 cons:cons.lspy:4000 \
+             deep:deep.lspy:202000 env:env.lspy:20000 map:map.lspy:20000; do
+	IFS=: read name script ops <<< "$entry"
+	result=$("$LISPY" "$BENCH/$script" | tail -n 1 | tr -d '{}')
+	read wall cpu allocs value <<< "$result"
+	if [ -z "$allocs" ]; then
+		echo "$name failed: $result" >&2
+		exit 1
+	fi
+	report $name $ops $wall $cpu $allocs
+done
+
+#Large parse: time a whole run over a generated script of simple definitions
+
+FORMS=50000
+PARSE=$(mktemp)
+trap 'rm -f "$PARSE"' EXIT
+awk -v n=$FORMS 'BEGIN {
+	for (i = 0; i < n; i++) {
+		printf "(def {p%d} {1 -2 30 (foo %d bar) {baz {qux 4 5}} + - * /})\n", i % 100, i
+	}
+}' > "$PARSE"
+
+start=$(date +%s%N)
+"$LISPY" "$PARSE" > /dev/null
+end=$(date +%s%N)
+wall=$(( (end - start) / 1000 ))
+report parse $FORMS $wall $wall -
@@ -6,4 +6,4 @@
 #!/bin/bash
 clear       
 echo Compiling... $1.c
-cc -std=c99 -Wall -ggdb $1.c mpc.c -ledit -lm -o $1.exe
+cc -std=c11 -Wall -ggdb $1.c mpc.c -ledit -lm -pthread -o $1.exe
@@ -23,9 +23,9 @@
 	}
 
 #define LASSERT_TYPE(func, args, index, expect) \
-	LASSERT(args, args->cell[index]->type == expect, \
+	LASSERT(args, ltype(args->cell[index]) == expect, \
 		"Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-		func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+		func, index, ltype_name(ltype(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
 	LASSERT(args, args->count == num, \
@@ -39,9 +39,27 @@
 
 /* Requires sudo apt-get install libedit-dev */
 
+/* Expose fileno, mmap and friends when compiling with -std=c11 */
+
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+/* The parallel builtins run on POSIX threads where available */
+
+#if !defined(_WIN32) && !defined(LISPY_NO_THREADS)
+	#define LISPY_THREADS
+	#include <pthread.h>
+#endif
+
+#ifndef __STDC_NO_ATOMICS__
+	#include <stdatomic.h>
+#endif
 
 /* Include Daniel Holden's MPC "...lightweight and powerful Parser Combinator" library
  *
@@ -51,22 +69,51 @@
 
 #include "mpc.h"
 
+/* Declare the embedding interface implemented at the end of this file */
+
+#include "lispy.h"
+
 /* Accomidate compiling on Windows which doesn't have editline available */
 
 #ifdef _WIN32
 
 	#include <string.h>
+	#include <io.h>
 
-	static char buffer[2048];
+	#define isatty _isatty
+	#define fileno _fileno
+	#define write  _write
 
-	/* Fake readline function */
+	/* Fake readline function, growing its buffer to fit lines of any length */
 
 	char* readline(char* prompt) {
   		fputs(prompt, stdout);
-  		fgets(buffer, 2048, stdin);
-  		char* cpy = malloc(strlen(buffer)+1);
-  		strcpy(cpy, buffer);
-  		cpy[strlen(cpy)-1] = '\0';
+  		fflush(stdout);
+
+  		size_t cap = 256;
+  		size_t len = 0;
+  		char*  cpy = malloc(cap);
+  		int c;
+
+  		while ((c = fgetc(stdin)) != EOF && c != '\n') {
+  			if (len + 1 == cap) {
+  				cap *= 2;
+  				cpy = realloc(cpy, cap);
+  			}
+  			cpy[len++] = c;
+  		}
+
+  		/* Signal the end of input like readline does */
+
+  		if (c == EOF && len == 0) {
+  			free(cpy);
+  			return NULL;
+  		}
+
+  		if (len > 0 && cpy[len-1] == '\r') {
+  			len--;
+  		}
+  		cpy[len] = '\0';
   		return cpy;
 	}
 
@@ -81,63 +128,267 @@
 	#include <editline/readline.h>
 	#include <editline/history.h>
 
+	/* Script files are memory mapped where available */
+
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+
 #endif
 
 /* Handle all needed forward declarations */
 
 struct lval;
 struct lenv;
+struct lcode;
+struct lmemo;
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lmemo lmemo;
 
 void  lval_print(lval* v);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_join(lval* x, lval* y);
+lval* lval_copy(lval* v);
+void  lval_del(lval* v);
 void  lenv_del(lenv* e);
 lenv* lenv_copy(lenv* e);
 lval* builtin(lenv* e, lval* a, char* func);
-lval* builtin_op(lenv* e, lval* a, char* op);
 lval* builtin_eval(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_memo_call(lenv* e, lval* a);
+lval* builtin_quit(lenv* e, lval* a);
+lval* builtin_quit_value(lenv* e, lval* a);
+bool  lval_is_quit(lval* x);
+lval* lval_apply(lenv* e, lval* v);
+lval* lval_apply_tail(lenv* e, lval* v, lval** tail);
+lval* lval_eval_sexpr_tail(lenv* e, lval* v, lval** tail);
+int   lenv_find_arg(lenv* e, char* sym);
+lcode* lcode_compile(lval* formals, lval* body);
+void  lcode_del(lcode* c);
+lval* lvm_run(lenv* e, lcode* c, lval** tail);
+lval* lpar_lookup(lval* k, unsigned long hash);
+lval* lmemo_call(lenv* e, lmemo* m, lval* a);
+lval* lval_memo(lval* fn, int capacity);
+void  lmemo_del(lmemo* m);
+long  lmemo_bytes(lmemo* m);
+void  lenv_add_builtins(lenv* e);
+int   lmap_find(lval* m, lval* k, unsigned long hash);
+bool  lmap_live(lval* m, int i);
+void  lmap_index(lval* m, int i);
+void  lmap_put(lval* m, lval* k, lval* v);
 
 /* Declare lbuiltin function pointer */
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+lbuiltin lbuiltin_pure(char* sym);
+
 /* Declare lval structure to carry errors and support multiple types */
 
 struct lval {
 	int      type;        // lisp value type
+	int      refs;        // number of owners sharing this value
+
+	union {
+
+		/* Basic attributes */
+
+		long     num;         // numeric value too large to be an immediate
+		char*    err;         // error string
+		char*    sym;         // symbol string (interned)
+
+		/* Function attributes */
+
+		struct {
+			lbuiltin builtin;     // built-in function pointer
+			char*    name;        // built-in function name
+			lenv*    env;         // environment to store arguments
+			lval*    formals;     // formal arguments
+			lval*    body;        // Q-expression body of arguments
+			lcode*   code;        // resolved formals and compiled body (shared by copies)
+			int      bound;       // number of formals already bound by partial application
+			bool     special;     // built-in special form taking its arguments unevaluated
+			lmemo*   memo;        // results cache of a memoized function (shared by copies)
+		};
+
+		/* Expression attributes */
+
+		struct {
+			int      count;       // number of cells in use
+			int      cap;         // allocated length of the cell vector
+			struct   lval** cell; // first cell in use (self-referential pointer)
+			struct   lval** base; // start of the allocated cell vector
+			unsigned long  hash;  // cached hash of the cells (0 until computed, see lval_hash)
+			struct   lval* whole; // list whose cells a slice views, NULL when they are its own
+		};
+
+		/* Vector attributes */
+
+		struct {
+			int      vcount;      // number of elements
+			long*    vdata;       // packed elements
+		};
+
+		/* Map attributes, the arrays belonging to the map at the root of its versions */
+
+		struct {
+			int            mcount;  // number of keys
+			int            mlen;    // entries of the log this version sees
+			int            mused;   // entries in the log, seen by this version or by later ones
+			int            msize;   // allocated length of mkeys, mvals and mhashes
+			int            mslots;  // length of mindex (0 or a power of two)
+			lval**         mkeys;   // key of each entry in the order they were put, see lmap_del
+			lval**         mvals;   // value of each entry, NULL where the key was deleted
+			unsigned long* mhashes; // lval_hash of each key
+			int*           mindex;  // position in mkeys/mvals or -1 if empty
+			struct lval*   mwhole;  // map whose log a version views, NULL when its own
+		};
+
+		/* Promise attributes */
+
+		struct {
+			lval*    delayed;     // expression still to be evaluated, NULL once forced
+			lval*    forced;      // value of the expression once forced
+		};
+	};
+};
+
+/* Frames with at most this many formals keep them inside the lenv itself */
+
+#define LENV_FEW_ARGS 4
+
+/* Declare enviornment structure to hold defined variables
+ *
+ * Symbols and values are kept in insertion order in parallel arrays (along with
+ * each symbol's precomputed hash) while 'index' is an open-addressing hash table
+ * of positions into those arrays, so a lookup costs one hash and a short probe
+ * no matter how many variables have been defined.
+ */
 
-	/* Basic attributes */
+struct lenv {
+	lenv*	        par;
+	int 	        count;    // number of defined variables
+	int             size;     // allocated length of syms, vals and hashes
+	int             slots;    // length of index (always a power of two)
+	char**	        syms;
+	lval**	        vals;
+	unsigned long*  hashes;
+	int*            index;    // position in syms/vals or -1 if empty
+	unsigned long   version;  // changed by every put into a global environment, 0 otherwise
+
+	/* Function call frames also bind the formal arguments by position */
+
+	int             nargs;    // number of formals (including any '&')
+	char**          arg_syms; // symbol of each formal (NULL for '&'), shared with the code
+	lval**          args;     // value bound to each formal or NULL if not yet bound
+	lval*           few_args[LENV_FEW_ARGS]; // storage for args when there are only a few
+};
 
-	long     num;         // numeric value
-	char*    err;         // error string
-	char*    sym;         // symbol sting
+/* An inline cache borrows the value, which stays bound while the version holds */
 
-	/* Function attributes */
+typedef struct lcache {
+	unsigned long version;
+	lval*         value;
+} lcache;
 
-	lbuiltin builtin;     // built-in function pointer
-	lenv*    env;         // environment to store arguments
-	lval*    formals;     // formal arguments
-	lval*    body;        // Q-expression body of arguments
+/* Declare the bytecode used to run lambda bodies
+ *
+ * A body is compiled once into a flat array of instructions for a simple stack
+ * machine.  Each expression leaves exactly one value on the stack: constants
+ * and symbol lookups push a value and LOP_CALL replaces the evaluated elements
+ * of an s-expression by the result of applying them, exactly as lval_apply
+ * does for the tree walker.
+ *
+ * Calls of the form (if c {then} {else}) are compiled into a conditional jump
+ * over the inlined branches.  LOP_IF checks at run time that 'if' is still the
+ * built-in and the condition a number, otherwise it performs the ordinary call.
+ *
+ * Calls of pure arithmetic, comparison and logic builtins on constants, such
+ * as (* 60 60 24), are evaluated once when compiling.  LOP_FOLD pushes the
+ * result after checking that each operator symbol involved still names the
+ * same builtin, otherwise it runs the ordinary code compiled after it.  Its
+ * inline cache holds the global version the check last passed at, which
+ * stands for the check just as it does for a LOP_LOAD (see below).
+ *
+ * Every other call checks with LOP_FORM once its first element is evaluated
+ * whether that is a special form. If so the form is applied to the rest of
+ * the elements unevaluated, otherwise they are evaluated as usual.
+ *
+ * Each LOP_LOAD has an inline cache of the global value it last found.  The
+ * cache holds while the global environment keeps the version it was filled at
+ * and the symbol has never been bound anywhere else, as then no frame on the
+ * (dynamic) chain can hide the global binding.
+ */
 
-	/* Expression attributes */
+enum lcode_ops {
+	LOP_CONST,      // k                       push constant k
+	LOP_LOAD,       // k ic                    push value of symbol constant k, cached in ic
+	LOP_LOCAL,      // i                       push value bound to formal i
+	LOP_CALL,       // n                       apply the top n values
+	LOP_TAILCALL,   // n                       apply the top n values in tail position
+	LOP_IF,         // kthen kelse else end    branch on condition (see above)
+	LOP_JUMP,       // target                  continue at target
+	LOP_RETURN,     //                         return the top value
+	LOP_FOLD,       // k ic n end (ksym kfun)*n   push folded constant k, checked in ic (see above)
+	LOP_FORM        // kargs end               apply a special form to constant kargs
+};
 
-	int      count;       // number of symbols
-	struct   lval** cell; // self-referential pointer
+struct lcode {
+	int     refs;       // number of lambdas sharing this code
+	int     count;      // number of instruction words
+	int     size;       // allocated length of ops
+	int*    ops;        // opcodes each followed by their operands
+	int     nconsts;    // number of constants
+	int     csize;      // allocated length of consts
+	lval**  consts;     // constants and symbols referenced by the code
+	int     depth;      // stack depth reached at the current point of compilation
+	int     max_depth;  // deepest stack needed when running
+	int     nargs;      // number of formals
+	char**  arg_syms;   // symbol of each formal, NULL for '&'
+	char*   name;       // symbol the lambda was first defined as, for the profiler
+	int     mark;       // collection in which the collector last reached this code
+	int     ncaches;    // number of inline caches
+	lcache* caches;     // inline cache of each global lookup
 };
 
-/* Declare enviornment structure to hold defined variables */
+/* Declare the results cache of a memoized function
+ *
+ * Entries are chained from buckets by the structural hash of their argument
+ * list and are kept on a list from most to least recently used, so that once
+ * the table is full the least recently used is replaced.  Both arrays grow as
+ * entries are added, so a large capacity only costs memory once it is used.
+ */
 
-struct lenv {
-	lenv*	par;
-	int 	count;
-	char**	syms;
-	lval**	vals;
+typedef struct lmemo_entry {
+	unsigned long hash;
+	lval*         args;       // argument list, NULL while the entry is unused
+	lval*         value;
+	int           chain;      // next entry in the bucket or -1
+	int           newer;      // neighbours in order of use or -1
+	int           older;
+} lmemo_entry;
+
+struct lmemo {
+	int           refs;       // number of function values sharing the table
+	int           mark;       // collection in which the collector last reached this table
+	lval*         fn;         // function memoized
+	int           capacity;   // most entries kept
+	int           count;
+	int           size;       // allocated length of entries
+	lmemo_entry*  entries;
+	int*          buckets;    // first entry of each chain or -1, a power of two of them
+	int           nbuckets;
+	int           newest;     // ends of the list in order of use or -1
+	int           oldest;
+	long          hits;
+	long          misses;
 };
 
 /* Create enumerated types for supported lisp value types */
@@ -149,14 +400,220 @@ enum lval_types {
 	LVAL_SYM,
 	LVAL_FUN,
 	LVAL_SEXPR,
-	LVAL_QEXPR
+	LVAL_QEXPR,
+	LVAL_VEC,
+	LVAL_PROMISE,
+	LVAL_MAP
 };
 
+/* Declare immediate numbers and booleans
+ *
+ * Nodes are always at least 8 byte aligned, so the low bits of a real lval
+ * pointer are zero.  Numbers that fit in the remaining bits, and booleans, are
+ * instead encoded directly in the pointer with one of those bits set.  They are
+ * never allocated, counted or freed, so arithmetic produces no garbage.  Only
+ * numbers too large for an immediate are allocated as LVAL_NUM nodes.
+ *
+ * All reads of an lval's type and numeric value go through ltype and lnum.
+ */
+
+#define LVAL_IMM_MASK  3
+#define LVAL_IMM_NUM   1
+#define LVAL_IMM_BOOL  2
+#define LVAL_IMM_MIN   (INTPTR_MIN / 4)
+#define LVAL_IMM_MAX   (INTPTR_MAX / 4)
+
+#define LVAL_IS_IMM(v) (((uintptr_t) (v)) & LVAL_IMM_MASK)
+
+/* Return the type of any lisp value */
+
+static inline int ltype(lval* v) {
+	switch (((uintptr_t) v) & LVAL_IMM_MASK) {
+		case LVAL_IMM_NUM:
+			return LVAL_NUM;
+		case LVAL_IMM_BOOL:
+			return LVAL_BOOL;
+		default:
+			return v->type;
+	}
+}
+
+/* Return the value of a number or boolean (relies on arithmetic right shift) */
+
+static inline long lnum(lval* v) {
+	if (LVAL_IS_IMM(v)) {
+		return (long) (((intptr_t) v) >> 2);
+	}
+	return v->num;
+}
+
+/* Declare the node pools used to allocate lval and lenv structures
+ *
+ * Nodes are carved out of large chunks and recycled through a free list rather
+ * than going through malloc and free one at a time.  Define LISPY_NO_POOL to
+ * fall back to plain malloc and free (e.g. when hunting leaks with a checker).
+ */
+
+typedef struct lpool {
+	size_t  size;         // node size in bytes
+	int     per_chunk;    // nodes carved from each chunk
+	void*   free;         // list of recycled nodes linked through their first word
+	void*   chunks;       // list of chunks linked through their first word
+	long    chunk_count;  // number of chunks allocated
+	long    allocs;       // nodes handed out in total
+	long    frees;        // nodes returned in total
+} lpool;
+
+/* Each thread allocates from, and frees back to, its own pools */
+
+static _Thread_local lpool lval_pool = { sizeof(lval), 1024 };
+static _Thread_local lpool lenv_pool = { sizeof(lenv), 256  };
+
+/* Resource limits
+ *
+ * An evaluation can be bounded in the calls it makes (steps), how deeply
+ * lambda calls nest (depth) and the memory held in nodes and the storage
+ * behind them (bytes), where 0 is no limit.  Calls check the limits, as does the allocator
+ * when it grows, and once one is exceeded every call fails with the same error
+ * so that the error unwinds whatever was being evaluated.  The counters are
+ * reset before each top level form, or each string given to an embedded
+ * instance, except for bytes which are those in use.
+ */
+
+typedef struct llimits {
+	long steps;
+	long depth;
+	long bytes;
+} llimits;
+
+enum { LLIM_NONE, LLIM_STEPS, LLIM_DEPTH, LLIM_BYTES };
+
+static _Thread_local llimits llim_max    = { 0, 0, 0 };
+static _Thread_local bool    llim_on     = false;      // whether any limit is set
+static _Thread_local int     llim_breach = LLIM_NONE;  // the limit exceeded, if any
+static _Thread_local long    llim_steps  = 0;          // calls made since the reset
+static _Thread_local long    llim_depth  = 0;          // lambda calls now running
+static _Thread_local long    llim_peak   = 0;          // deepest nesting since the reset
+static _Thread_local long    llim_data   = 0;          // bytes of storage behind the nodes
+
+void llim_set(llimits max) {
+	llim_max = max;
+	llim_on  = max.steps || max.depth || max.bytes;
+}
+
+void llim_reset(void) {
+	llim_steps  = 0;
+	llim_peak   = llim_depth;
+	llim_breach = LLIM_NONE;
+}
+
+long llim_bytes(void) {
+	return (lval_pool.allocs - lval_pool.frees) * (long) lval_pool.size +
+		(lenv_pool.allocs - lenv_pool.frees) * (long) lenv_pool.size + llim_data;
+}
+
+/* Note memory taken or given back, marking the limit exceeded when over it */
+
+static inline void llim_charge(long bytes) {
+	llim_data += bytes;
+	if (llim_max.bytes && (bytes >= 0) && (llim_bytes() > llim_max.bytes)) {
+		llim_breach = LLIM_BYTES;
+	}
+}
+
+/* Bytes of the storage behind a value or an environment, charged while they hold it */
+
+long lval_bytes(lval* v) {
+	switch (ltype(v)) {
+		case LVAL_ERR:
+			return strlen(v->err) + 1;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			return sizeof(lval*) * v->cap;
+		case LVAL_VEC:
+			return sizeof(long) * ((v->vcount) ? v->vcount : 1);
+		case LVAL_MAP:
+			return (sizeof(lval*) * 2 + sizeof(unsigned long)) * v->msize + sizeof(int) * v->mslots;
+	}
+	return 0;
+}
+
+long lenv_bytes(lenv* e) {
+	long args = (e->args != e->few_args) ? sizeof(lval*) * e->nargs : 0;
+	return args + (sizeof(char*) + sizeof(lval*) + sizeof(unsigned long)) * e->size +
+		sizeof(int) * e->slots;
+}
+
+/* Hand out a node, carving a new chunk when the free list runs dry */
+
+void* lpool_alloc(lpool* p) {
+
+	p->allocs++;
+
+#ifdef LISPY_NO_POOL
+	return malloc(p->size);
+#else
+	if (!p->free) {
+
+		llim_charge(0);
+
+		/* The first node sized slot of a chunk links it into the chunk list */
+
+		char* chunk = malloc(p->size * (p->per_chunk + 1));
+		*(void**) chunk = p->chunks;
+		p->chunks = chunk;
+		p->chunk_count++;
+
+		for (int i = p->per_chunk; i > 0; i--) {
+			void* n = chunk + p->size * i;
+			*(void**) n = p->free;
+			p->free = n;
+		}
+	}
+
+	void* n = p->free;
+	p->free = *(void**) n;
+	return n;
+#endif
+}
+
+/* Return a node to its pool */
+
+void lpool_free(lpool* p, void* n) {
+
+	p->frees++;
+
+#ifdef LISPY_NO_POOL
+	free(n);
+#else
+	*(void**) n = p->free;
+	p->free = n;
+#endif
+}
+
+/* Release all the memory held by a pool */
+
+void lpool_cleanup(lpool* p) {
+	while (p->chunks) {
+		void* next = *(void**) p->chunks;
+		free(p->chunks);
+		p->chunks = next;
+	}
+	p->free = NULL;
+	p->chunk_count = 0;
+}
+
 /* Construct a pointer to a new number type lisp value */
 
 lval* lval_num(long x) {
-	lval* v = malloc(sizeof(lval));
+
+	if ((x >= LVAL_IMM_MIN) && (x <= LVAL_IMM_MAX)) {
+		return (lval*) (((uintptr_t) x << 2) | LVAL_IMM_NUM);
+	}
+
+	lval* v = lpool_alloc(&lval_pool);
 	v->type = LVAL_NUM;
+	v->refs = 1;
 	v->num  = x;
 	return v;
 }
@@ -164,18 +621,16 @@ lval* lval_num(long x) {
 /* Construct a pointer to a new boolean type lisp value */
 
 lval* lval_bool(bool x) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_BOOL;
-	v->num  = (x) ? 1 : 0;
-	return v;
+	return (lval*) (((uintptr_t) ((x) ? 1 : 0) << 2) | LVAL_IMM_BOOL);
 }
 
 /* Construct a pointer to a new error type lisp value */
 
 lval* lval_err(char* fmt, ...) {
 
-	lval* v = malloc(sizeof(lval));
+	lval* v = lpool_alloc(&lval_pool);
 	v->type = LVAL_ERR;
+	v->refs = 1;
 
 	/* Create an initialize a va list */
 
@@ -193,6 +648,7 @@ lval* lval_err(char* fmt, ...) {
 	/* reallocated the buffer space to the amount really used */
 
 	v->err = realloc(v->err, strlen(v->err)+1);
+	llim_charge(strlen(v->err) + 1);
 
 	/* And, clean up */
 
@@ -202,77 +658,385 @@ lval* lval_err(char* fmt, ...) {
 
 }
 
+/* Declare the symbol intern table
+ *
+ * Each distinct symbol string is stored exactly once so that symbol lvals and
+ * environments can share the string and compare symbols by pointer.  The byte
+ * before each string holds flags about the symbol.
+ */
+
+static char** lsym_table = NULL;
+static int    lsym_count = 0;
+static int    lsym_slots = 0;
+
+#ifdef LISPY_THREADS
+static pthread_mutex_t lsym_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Well known symbols used by the evaluator */
+
+static char*  lsym_amp   = NULL;
+static char*  lsym_quit  = NULL;
+static char*  lsym_if    = NULL;
+
+/* The symbol is, or has been, bound other than in a global environment, as a formal or local */
+
+#define LSYM_LOCAL 1
+
+static inline bool lsym_is_local(char* sym) {
+#ifndef __STDC_NO_ATOMICS__
+	return atomic_load_explicit((atomic_uchar*) (sym - 1), memory_order_relaxed) & LSYM_LOCAL;
+#else
+	return sym[-1] & LSYM_LOCAL;
+#endif
+}
+
+static inline void lsym_set_local(char* sym) {
+	if (!lsym_is_local(sym)) {
+#ifndef __STDC_NO_ATOMICS__
+		atomic_fetch_or_explicit((atomic_uchar*) (sym - 1), LSYM_LOCAL, memory_order_relaxed);
+#else
+		sym[-1] |= LSYM_LOCAL;
+#endif
+	}
+}
+
+/* Hash a symbol string (FNV-1a) */
+
+unsigned long lsym_hash(char* s) {
+	unsigned long h = 2166136261UL;
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+/* Return the single shared copy of a symbol string, adding it if it is new */
+
+char* lsym_intern(char* s) {
+
+#ifdef LISPY_THREADS
+	pthread_mutex_lock(&lsym_lock);
+#endif
+
+	/* Keep the table no more than half full, rehashing into a larger one as needed */
+
+	if ((lsym_count + 1) * 2 > lsym_slots) {
+		int slots = (lsym_slots) ? lsym_slots * 2 : 256;
+		char** table = calloc(slots, sizeof(char*));
+		for (int i = 0; i < lsym_slots; i++) {
+			if (lsym_table[i]) {
+				int j = lsym_hash(lsym_table[i]) & (slots - 1);
+				while (table[j]) {
+					j = (j + 1) & (slots - 1);
+				}
+				table[j] = lsym_table[i];
+			}
+		}
+		free(lsym_table);
+		lsym_table = table;
+		lsym_slots = slots;
+	}
+
+	/* Probe for an existing copy, otherwise store a new one in the empty slot found */
+
+	int mask = lsym_slots - 1;
+	int i = lsym_hash(s) & mask;
+	while (lsym_table[i] && (strcmp(lsym_table[i], s) != 0)) {
+		i = (i + 1) & mask;
+	}
+
+	if (!lsym_table[i]) {
+		char* flags = malloc(strlen(s) + 2);
+		flags[0] = 0;
+		lsym_table[i] = strcpy(flags + 1, s);
+		lsym_count++;
+	}
+
+	char* sym = lsym_table[i];
+
+#ifdef LISPY_THREADS
+	pthread_mutex_unlock(&lsym_lock);
+#endif
+
+	return sym;
+}
+
+/* Set up the well known symbols */
+
+void lsym_init(void) {
+	lsym_amp  = lsym_intern("&");
+	lsym_quit = lsym_intern("quit");
+	lsym_if   = lsym_intern("if");
+}
+
+/* Release every interned symbol string */
+
+void lsym_cleanup(void) {
+	for (int i = 0; i < lsym_slots; i++) {
+		if (lsym_table[i]) {
+			free(lsym_table[i] - 1);
+		}
+	}
+	free(lsym_table);
+	lsym_table = NULL;
+	lsym_count = 0;
+	lsym_slots = 0;
+}
+
 /* Construct a pointer to a new symbol type lisp value */
 
 lval* lval_sym(char* s) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lpool_alloc(&lval_pool);
 	v->type = LVAL_SYM;
-	v->sym  = malloc(strlen(s) + 1);
-	strcpy(v->sym, s);
+	v->refs = 1;
+	v->sym  = lsym_intern(s);
 	return v;
 }
 
 /* Construct a pointer to a new empty s-expression lisp value */
 
 lval* lval_sexpr(void) {
-	lval* v  = malloc(sizeof(lval));
+	lval* v  = lpool_alloc(&lval_pool);
 	v->type  = LVAL_SEXPR;
+	v->refs  = 1;
 	v->count = 0;
+	v->cap   = 0;
 	v->cell  = NULL;
+	v->base  = NULL;
+	v->hash  = 0;
+	v->whole = NULL;
 	return v;
 }
 
 /* Construct a pointer to a new empty q-expression lisp value */
 
 lval* lval_qexpr(void) {
-	lval* v  = malloc(sizeof(lval));
+	lval* v  = lpool_alloc(&lval_pool);
 	v->type  = LVAL_QEXPR;
+	v->refs  = 1;
 	v->count = 0;
+	v->cap   = 0;
 	v->cell  = NULL;
+	v->base  = NULL;
+	v->hash  = 0;
+	v->whole = NULL;
+	return v;
+}
+
+/* Construct a pointer to a new packed numeric vector of n elements */
+
+lval* lval_vec(int n) {
+	lval* v   = lpool_alloc(&lval_pool);
+	v->type   = LVAL_VEC;
+	v->refs   = 1;
+	v->vcount = n;
+	v->vdata  = malloc(sizeof(long) * ((n) ? n : 1));
+	llim_charge(lval_bytes(v));
+	return v;
+}
+
+/* Construct a pointer to a new empty map */
+
+lval* lval_map(void) {
+	lval* v    = lpool_alloc(&lval_pool);
+	v->type    = LVAL_MAP;
+	v->refs    = 1;
+	v->mcount  = 0;
+	v->mlen    = 0;
+	v->mused   = 0;
+	v->msize   = 0;
+	v->mslots  = 0;
+	v->mkeys   = NULL;
+	v->mvals   = NULL;
+	v->mhashes = NULL;
+	v->mindex  = NULL;
+	v->mwhole  = NULL;
+	return v;
+}
+
+/* The map holding the log of a version, which is the map itself unless it is a view */
+
+static inline lval* lmap_store(lval* m) {
+	return (m->mwhole) ? m->mwhole : m;
+}
+
+/* Construct a pointer to a new promise of the value of an unevaluated expression */
+
+lval* lval_promise(lval* x) {
+	lval* v    = lpool_alloc(&lval_pool);
+	v->type    = LVAL_PROMISE;
+	v->refs    = 1;
+	v->delayed = x;
+	v->forced  = NULL;
 	return v;
 }
 
 /* Construct a built-in function */
 
 lval* lval_fun(lbuiltin func) {
-	lval* v    = malloc(sizeof(lval));
+	lval* v    = lpool_alloc(&lval_pool);
 	v->type    = LVAL_FUN;
+	v->refs    = 1;
 	v->builtin = func;
+	v->name    = NULL;
+	v->code    = NULL;
+	v->bound   = 0;
+	v->special = false;
+	v->memo    = NULL;
 	return v;
 }
 
 /* Construct an environment element */
 
 lenv* lenv_new(void) {
-	lenv* e = malloc(sizeof(lenv));
-	e->par   = NULL;
-	e->count = 0;
-	e->syms  = NULL;
-	e->vals  = NULL;
+	lenv* e  = lpool_alloc(&lenv_pool);
+	e->par    = NULL;
+	e->count  = 0;
+	e->size   = 0;
+	e->slots  = 0;
+	e->syms   = NULL;
+	e->vals   = NULL;
+	e->hashes = NULL;
+	e->index  = NULL;
+	e->version  = 0;
+	e->nargs    = 0;
+	e->arg_syms = NULL;
+	e->args     = NULL;
+	return e;
+}
+
+/* Construct a global environment, one which inline caches may look up in directly
+ *
+ * Versions are drawn from a single counter so that no two global environments,
+ * nor two states of one, ever share a version.
+ */
+
+#ifndef __STDC_NO_ATOMICS__
+static atomic_ulong lenv_versions = 0;
+#else
+static unsigned long lenv_versions = 0;
+#endif
+
+unsigned long lenv_next_version(void) {
+	return ++lenv_versions;
+}
+
+lenv* lenv_global(void) {
+	lenv* e = lenv_new();
+	e->version = lenv_next_version();
+	return e;
+}
+
+/* Construct an environment with room to bind 'nargs' formals */
+
+lenv* lenv_frame(int nargs, char** arg_syms) {
+	lenv* e = lenv_new();
+	e->nargs    = nargs;
+	e->arg_syms = arg_syms;
+	e->args     = (nargs <= LENV_FEW_ARGS) ? e->few_args : malloc(sizeof(lval*) * nargs);
+	for (int i = 0; i < nargs; i++) {
+		e->args[i] = NULL;
+	}
+	llim_charge(lenv_bytes(e));
 	return e;
 }
 
-/* Construct a lamda expression */
+/* Construct a lamda expression
+ *
+ * The formals are resolved to argument positions (and the body compiled) once
+ * here, so that calls bind arguments into a flat array in the environment.
+ */
 
 lval* lval_lambda(lval* formals, lval* body) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lpool_alloc(&lval_pool);
 	v->type    = LVAL_FUN;
+	v->refs    = 1;
 	v->builtin = NULL;
-	v->env     = lenv_new();
+	v->name    = NULL;
+	v->code    = lcode_compile(formals, body);
+	v->bound   = 0;
+	v->special = false;
+	v->memo    = NULL;
+	v->env     = lenv_frame(v->code->nargs, v->code->arg_syms);
 	v->formals = formals;
 	v->body    = body;
 	return v;
 }
 
-/* Destruct a lisp value */
+/* Share a lisp value by taking another reference to it */
+
+lval* lval_ref(lval* v) {
+	if (!LVAL_IS_IMM(v)) {
+		v->refs++;
+	}
+	return v;
+}
+
+/* Ensure the caller holds the only reference to a value before modifying it,
+ * replacing a shared value by a private copy of its top level.
+ */
+
+static inline bool lval_is_slice(lval* v) {
+	return ((v->type == LVAL_SEXPR) || (v->type == LVAL_QEXPR)) && v->whole;
+}
+
+lval* lval_own(lval* v) {
+	if (LVAL_IS_IMM(v) || ((v->refs == 1) && !lval_is_slice(v))) {
+		return v;
+	}
+	lval* x = lval_copy(v);
+	lval_del(v);
+	return x;
+}
+
+/* Construct a list of 'count' cells of another from 'offset' without copying them
+ *
+ * The slice holds a reference to the list whose cells it views, which, being
+ * shared, is copied by lval_own before it could be changed, so the cells never
+ * change under the slice.  The slice itself is always copied by lval_own.
+ */
+
+lval* lval_slice(lval* v, int offset, int count) {
+
+	if (count == 0) {
+		return (ltype(v) == LVAL_SEXPR) ? lval_sexpr() : lval_qexpr();
+	}
+
+	lval* x  = lpool_alloc(&lval_pool);
+	x->type  = v->type;
+	x->refs  = 1;
+	x->count = count;
+	x->cap   = 0;
+	x->cell  = v->cell + offset;
+	x->base  = NULL;
+	x->hash  = (count == v->count) ? v->hash : 0;
+	x->whole = lval_ref((v->whole) ? v->whole : v);
+	return x;
+}
+
+/* Destruct a lisp value once its last reference is released */
 
 void lval_del(lval* v) {
-	switch (v->type) {
+
+	if (LVAL_IS_IMM(v) || (--v->refs > 0)) {
+		return;
+	}
+
+	llim_charge(-lval_bytes(v));
+
+	switch (ltype(v)) {
 		case LVAL_FUN:
 			if (!v->builtin) {
 				lenv_del(v->env);
 				lval_del(v->formals);
 				lval_del(v->body);
+				if (v->code) {
+					lcode_del(v->code);
+				}
+			} else if (v->memo) {
+				lmemo_del(v->memo);
 			}
 			break;
 		case LVAL_NUM:
@@ -283,29 +1047,69 @@ void lval_del(lval* v) {
 			free(v->err);
 			break;
 		case LVAL_SYM:
-			free(v->sym);
+			// symbol strings are interned and never freed individually
 			break;
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
+			if (v->whole) {
+				lval_del(v->whole);
+				break;
+			}
 			for (int i = 0; i < v->count; i++) {
 				lval_del(v->cell[i]);
 			}
-			free(v->cell);
+			free(v->base);
+			break;
+		case LVAL_VEC:
+			free(v->vdata);
+			break;
+		case LVAL_MAP:
+			if (v->mwhole) {
+				lval_del(v->mwhole);
+				break;
+			}
+			for (int i = 0; i < v->mused; i++) {
+				lval_del(v->mkeys[i]);
+				if (v->mvals[i]) {
+					lval_del(v->mvals[i]);
+				}
+			}
+			free(v->mkeys);
+			free(v->mvals);
+			free(v->mhashes);
+			free(v->mindex);
+			break;
+		case LVAL_PROMISE:
+			if (v->delayed) {
+				lval_del(v->delayed);
+			} else {
+				lval_del(v->forced);
+			}
 			break;
 	}
-	free(v);
+	lpool_free(&lval_pool, v);
 }
 
 /* Destruct an environment value */
 
 void lenv_del(lenv* e) {
+	llim_charge(-lenv_bytes(e));
 	for (int i = 0; i < e->count; i++) {
-		free(e->syms[i]);
 		lval_del(e->vals[i]);
 	}
+	for (int i = 0; i < e->nargs; i++) {
+		if (e->args[i]) {
+			lval_del(e->args[i]);
+		}
+	}
+	if (e->args != e->few_args) {
+		free(e->args);
+	}
 	free(e->syms);
 	free(e->vals);
-	free(e);
+	free(e->hashes);
+	free(e->index);
+	lpool_free(&lenv_pool, e);
 }
 
 /* Return a nice name for an argument type */
@@ -326,17 +1130,60 @@ char* ltype_name(int t) {
 			return "S-Expression";
 		case LVAL_QEXPR:
 			return "Q-Expression";
+		case LVAL_VEC:
+			return "Vector";
+		case LVAL_PROMISE:
+			return "Promise";
+		case LVAL_MAP:
+			return "Map";
 		default:
 			return "Unknown";
 	}
 }
 
+/* Make room for at least n more cells at the end of an expression
+ *
+ * Cells popped from the front leave free space before 'cell'.  When that space
+ * is at least half the vector it is reclaimed by sliding the cells down,
+ * otherwise the vector doubles in size, so appends are amortized O(1).
+ */
+
+void lval_reserve(lval* v, int n) {
+
+	int front = v->cell - v->base;
+
+	if (front + v->count + n <= v->cap) {
+		return;
+	}
+
+	if ((front > 0) && (v->count + n <= v->cap) && (front * 2 >= v->cap)) {
+		memmove(v->base, v->cell, sizeof(lval*) * v->count);
+		v->cell = v->base;
+		return;
+	}
+
+	int cap = (v->cap) ? v->cap * 2 : 4;
+	while (cap < v->count + n) {
+		cap *= 2;
+	}
+
+	lval** base = malloc(sizeof(lval*) * cap);
+	if (v->count) {
+		memcpy(base, v->cell, sizeof(lval*) * v->count);
+	}
+	free(v->base);
+	llim_charge((long) sizeof(lval*) * (cap - v->cap));
+	v->base = base;
+	v->cell = base;
+	v->cap  = cap;
+}
+
 /* Add a lisp value to an s-expression */
 
 lval* lval_add(lval* v, lval* x) {
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	v->cell[v->count-1] = x;
+	lval_reserve(v, 1);
+	v->cell[v->count++] = x;
+	v->hash = 0;
 	return v;
 }
 
@@ -397,25 +1244,236 @@ lval* lval_read(mpc_ast_t* t) {
 
 }
 
-/* Copy an lval */
+/* Hand-written reader
+ *
+ * Builds lvals in a single pass straight from the source text with no
+ * intermediate AST. It accepts the same language as the mpc grammar in main:
+ * numbers, booleans, symbols, and nesting of '(' ... ')' and '{' ... '}'.
+ * The text need not be NUL terminated, which lets whole files be read in place.
+ */
 
-lval* lval_copy(lval* v) {
-  
-	lval* x = malloc(sizeof(lval));
-	x->type = v->type;
-  
-  	switch (v->type) {
-    
-    	/* Copy Functions and Numbers Directly */
+typedef struct lreader {
+	char* name;           // input name used in error messages
+	char* pos;            // next character to read
+	char* end;            // one past the last character
+	char* line_start;     // first character of the current line
+	int   line;           // current line number, from 1
+} lreader;
+
+void lreader_init(lreader* r, char* name, char* src, size_t len) {
+	r->name       = name;
+	r->pos        = src;
+	r->end        = src + len;
+	r->line_start = src;
+	r->line       = 1;
+}
 
-    	case LVAL_FUN:
+/* Characters allowed in a symbol, matching the grammar's symbol regex */
+
+static inline bool lread_is_sym(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		|| (c != '\0' && strchr("_+-*/\\=<>!&%", c) != NULL);
+}
+
+static inline bool lread_is_digit(char c) {
+	return (c >= '0' && c <= '9');
+}
+
+/* Skip whitespace, keeping track of line numbers for error messages */
+
+static void lread_skip(lreader* r) {
+	while (r->pos < r->end) {
+		char c = *r->pos;
+		if (c == '\n') {
+			r->line++;
+			r->line_start = r->pos + 1;
+		} else if (c != ' ' && c != '\t' && c != '\r' && c != '\f' && c != '\v') {
+			return;
+		}
+		r->pos++;
+	}
+}
+
+static lval* lread_error(lreader* r, char* msg) {
+	return lval_err("%s:%i:%i: %s", r->name, r->line, (int)(r->pos - r->line_start) + 1, msg);
+}
+
+lval* lread_expr(lreader* r);
+
+/* Read the members of a list up to its closing bracket */
+
+static lval* lread_list(lreader* r, lval* x, char close) {
+
+	r->pos++;
+
+	while (true) {
+		lread_skip(r);
+
+		if (r->pos == r->end) {
+			lval_del(x);
+			return lread_error(r, (close == ')') ? "expected ')' before end of input"
+			                                     : "expected '}' before end of input");
+		}
+		if (*r->pos == close) {
+			r->pos++;
+			return x;
+		}
+
+		lval* y = lread_expr(r);
+		if (ltype(y) == LVAL_ERR) {
+			lval_del(x);
+			return y;
+		}
+		lval_add(x, y);
+	}
+}
+
+/* Read a single expression, the reader must be positioned at its first character */
+
+lval* lread_expr(lreader* r) {
+
+	char* start = r->pos;
+	char  c     = *start;
+
+	if (c == '(') { return lread_list(r, lval_sexpr(), ')'); }
+	if (c == '{') { return lread_list(r, lval_qexpr(), '}'); }
+
+	/* Numbers take priority over symbols, as they do in the grammar */
+
+	char* p = start;
+	if (c == '-' && p + 1 < r->end) {
+		p++;
+	}
+	if (lread_is_digit(*p)) {
+		while (p < r->end && lread_is_digit(*p)) {
+			p++;
+		}
+		r->pos = p;
+
+		/* strtol stops at the first non-digit, but digits running up to
+		   the end of the text must be copied out to terminate them */
+
+		char  buf[32];
+		char* digits = start;
+		if (p == r->end) {
+			long len = p - start;
+			digits = (len < (long)sizeof(buf)) ? buf : malloc(len + 1);
+			memcpy(digits, start, len);
+			digits[len] = '\0';
+		}
+		errno = 0;
+		long x = strtol(digits, NULL, 10);
+		if (digits != start && digits != buf) {
+			free(digits);
+		}
+		if (errno != ERANGE) {
+			return lval_num(x);
+		} else {
+			return lval_err("Error: Invalid number");
+		}
+	}
+
+	if (lread_is_sym(c)) {
+		p = start;
+		while (p < r->end && lread_is_sym(*p)) {
+			p++;
+		}
+		r->pos = p;
+
+		long len = p - start;
+		if (len == 4 && strncmp(start, "true", 4) == 0)  { return lval_bool(true); }
+		if (len == 5 && strncmp(start, "false", 5) == 0) { return lval_bool(false); }
+
+		/* Symbols are interned from a terminated copy */
+
+		char  buf[64];
+		char* name = (len < (long)sizeof(buf)) ? buf : malloc(len + 1);
+		memcpy(name, start, len);
+		name[len] = '\0';
+		lval* x = lval_sym(name);
+		if (name != buf) {
+			free(name);
+		}
+		return x;
+	}
+
+	if (c == ')' || c == '}') {
+		return lread_error(r, (c == ')') ? "unexpected ')'" : "unexpected '}'");
+	}
+
+	char msg[32];
+	snprintf(msg, sizeof(msg), "unexpected character '%c'", c);
+	return lread_error(r, msg);
+}
+
+/* Read the next top level expression, returning NULL at the end of the input */
+
+lval* lread_next(lreader* r) {
+	lread_skip(r);
+	if (r->pos == r->end) {
+		return NULL;
+	}
+	return lread_expr(r);
+}
+
+/* Read every remaining expression into one s-expression, as the REPL evaluates a line */
+
+lval* lread_all(lreader* r) {
+	lval* x = lval_sexpr();
+	lval* y;
+	while ((y = lread_next(r))) {
+		if (ltype(y) == LVAL_ERR) {
+			lval_del(x);
+			return y;
+		}
+		lval_add(x, y);
+	}
+	return x;
+}
+
+/* Copy an lval
+ *
+ * Only the top level is duplicated: sub-expressions, formals and bodies are
+ * shared by reference and copied on demand by lval_own when they are modified.
+ */
+
+lval* lval_copy(lval* v) {
+
+	/* Immediates are their own copy */
+
+	if (LVAL_IS_IMM(v)) {
+		return v;
+	}
+  
+	lval* x = lpool_alloc(&lval_pool);
+	x->type = v->type;
+	x->refs = 1;
+  
+  	switch (ltype(v)) {
+    
+    	/* Copy Functions and Numbers Directly */
+
+    	case LVAL_FUN:
+    		x->name = v->name;
     		if (v->builtin) {
 	    		x->builtin = v->builtin;
+	    		x->code    = NULL;
+	    		x->bound   = 0;
+	    		x->special = v->special;
+	    		x->memo    = v->memo;
+	    		if (x->memo) {
+	    			x->memo->refs++;
+	    		}
 	    	} else {
+	    		x->special = false;
+	    		x->memo    = NULL;
 	    		x->builtin = NULL;
 	    		x->env     = lenv_copy(v->env);
-	    		x->formals = lval_copy(v->formals);
-	    		x->body    = lval_copy(v->body);
+	    		x->formals = lval_ref(v->formals);
+	    		x->body    = lval_ref(v->body);
+	    		x->code    = v->code;
+	    		x->code->refs++;
+	    		x->bound   = v->bound;
 	    	}
     		break;
     	case LVAL_NUM:
@@ -423,61 +1481,248 @@ lval* lval_copy(lval* v) {
     		x->num = v->num;
     		break;
     
-	    /* Copy Strings using malloc and strcpy */
+	    /* Copy Strings using malloc and strcpy, except symbols which are shared */
 
 	    case LVAL_ERR:
 	    	x->err = malloc(strlen(v->err) + 1);
 	    	strcpy(x->err, v->err);
 	    	break;
  		case LVAL_SYM:
- 			x->sym = malloc(strlen(v->sym) + 1);
- 			strcpy(x->sym, v->sym);
+ 			x->sym = v->sym;
  			break;
 
-	    /* Copy Lists by copying each sub-expression */
+	    /* Copy Lists, and slices, by sharing each sub-expression */
 
 	    case LVAL_SEXPR:
     	case LVAL_QEXPR:
       		x->count = v->count;
-      		x->cell = malloc(sizeof(lval*) * x->count);
+      		x->cap   = v->count;
+      		x->cell  = malloc(sizeof(lval*) * x->count);
+      		x->base  = x->cell;
+      		x->hash  = v->hash;
+      		x->whole = NULL;
       		for (int i = 0; i < x->count; i++) {
-        		x->cell[i] = lval_copy(v->cell[i]);
+        		x->cell[i] = lval_ref(v->cell[i]);
       		}
     		break;
+
+	    /* Copies of a promise share its expression or value */
+
+	    case LVAL_PROMISE:
+	    	x->delayed = (v->delayed) ? lval_ref(v->delayed) : NULL;
+	    	x->forced  = (v->forced)  ? lval_ref(v->forced)  : NULL;
+	    	break;
+
+	    /* Copy Vectors element by element */
+
+	    case LVAL_VEC:
+	    	x->vcount = v->vcount;
+	    	x->vdata  = malloc(sizeof(long) * ((v->vcount) ? v->vcount : 1));
+	    	memcpy(x->vdata, v->vdata, sizeof(long) * v->vcount);
+	    	break;
+
+	    /* Copy Maps by sharing the key and value of each entry the version sees */
+
+	    case LVAL_MAP: {
+	    	lval* s = lmap_store(v);
+	    	x->mcount  = v->mcount;
+	    	x->mlen    = v->mcount;
+	    	x->mused   = v->mcount;
+	    	x->msize   = v->mcount;
+	    	x->mslots  = 0;
+	    	x->mkeys   = NULL;
+	    	x->mvals   = NULL;
+	    	x->mhashes = NULL;
+	    	x->mindex  = NULL;
+	    	x->mwhole  = NULL;
+	    	if (x->mcount) {
+	    		x->mkeys   = malloc(sizeof(lval*) * x->mcount);
+	    		x->mvals   = malloc(sizeof(lval*) * x->mcount);
+	    		x->mhashes = malloc(sizeof(unsigned long) * x->mcount);
+	    		int j = 0;
+	    		for (int i = 0; i < v->mlen; i++) {
+	    			if (lmap_live(v, i)) {
+	    				x->mkeys[j]   = lval_ref(s->mkeys[i]);
+	    				x->mvals[j]   = lval_ref(s->mvals[i]);
+	    				x->mhashes[j] = s->mhashes[i];
+	    				j++;
+	    			}
+	    		}
+	    		x->mslots = 16;
+	    		while (x->mcount * 2 > x->mslots) {
+	    			x->mslots *= 2;
+	    		}
+	    		x->mindex = malloc(sizeof(int) * x->mslots);
+	    		for (int i = 0; i < x->mslots; i++) {
+	    			x->mindex[i] = -1;
+	    		}
+	    		for (int i = 0; i < x->mcount; i++) {
+	    			lmap_index(x, i);
+	    		}
+	    	}
+	    	break;
+	    }
   	}
 
+  	llim_charge(lval_bytes(x));
   	return x;
 
 }
 
+/* Output buffers
+ *
+ * Values are printed into a growing buffer rather than with a stdio call for
+ * each piece.  A buffer with a file descriptor is written out in one go each
+ * time it fills LBUF_CHUNK bytes, and when flushed, while one without just
+ * grows, which is how values are printed into strings.
+ */
+
+#define LBUF_CHUNK 65536
+
+typedef struct lbuf {
+	char*  data;
+	size_t len;
+	size_t cap;
+	int    fd;       // descriptor written to, or -1 to keep everything
+	bool   lines;    // flushed at the end of each line, as for a terminal
+	bool   failed;   // a write failed, so the rest is discarded
+} lbuf;
+
+void lbuf_flush(lbuf* b) {
+
+	if (b->fd < 0) {
+		return;
+	}
+
+	size_t done = 0;
+	while ((done < b->len) && !b->failed) {
+		long n = (long) write(b->fd, b->data + done, b->len - done);
+		if (n > 0) {
+			done += n;
+		} else if ((n == 0) || (errno != EINTR)) {
+			b->failed = true;
+		}
+	}
+	b->len = 0;
+}
+
+/* Make room for n more bytes, writing out a full buffer rather than growing it */
+
+void lbuf_reserve(lbuf* b, size_t n) {
+
+	if (b->len + n <= b->cap) {
+		return;
+	}
+
+	if (b->fd >= 0) {
+		lbuf_flush(b);
+		if (n <= b->cap) {
+			return;
+		}
+	}
+
+	size_t cap = (b->cap) ? b->cap * 2 : LBUF_CHUNK;
+	while (cap < b->len + n) {
+		cap *= 2;
+	}
+	b->data = realloc(b->data, cap);
+	b->cap  = cap;
+}
+
+static inline void lbuf_putc(lbuf* b, char c) {
+	if (b->len == b->cap) {
+		lbuf_reserve(b, 1);
+	}
+	b->data[b->len++] = c;
+}
+
+void lbuf_write(lbuf* b, const char* s, size_t n) {
+	lbuf_reserve(b, n);
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+}
+
+void lbuf_puts(lbuf* b, const char* s) {
+	lbuf_write(b, s, strlen(s));
+}
+
+/* Append a number, formatting it without printf */
+
+void lbuf_putnum(lbuf* b, long x) {
+	char  digits[24];
+	char* p = digits + sizeof(digits);
+
+	unsigned long u = (x < 0) ? -(unsigned long) x : (unsigned long) x;
+	do {
+		*--p = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	if (x < 0) {
+		*--p = '-';
+	}
+
+	lbuf_write(b, p, digits + sizeof(digits) - p);
+}
+
+/* End a line, flushing a buffer for a terminal */
+
+void lbuf_newline(lbuf* b) {
+	lbuf_putc(b, '\n');
+	if (b->lines) {
+		lbuf_flush(b);
+	}
+}
+
+/* Write out and release a buffer */
+
+void lbuf_free(lbuf* b) {
+	lbuf_flush(b);
+	free(b->data);
+	b->data = NULL;
+	b->len  = 0;
+	b->cap  = 0;
+}
+
+/* Values print to the thread's buffer for stdout unless redirected, as into a string */
+
+static _Thread_local lbuf  lval_stdout = { NULL, 0, 0, 1, false, false };
+static _Thread_local lbuf* lval_out    = NULL;
+
+lbuf* lval_stream(void) {
+	return (lval_out) ? lval_out : &lval_stdout;
+}
+
 /* Print a lisp value expression */
 
 void lval_expr_print(lval* v, char open, char close) {
-	putchar(open);
+	lbuf* out = lval_stream();
+	lbuf_putc(out, open);
 	for (int i = 0; i < v->count; i++) {
 		lval_print(v->cell[i]);
 		if (i != (v->count - 1)) {
-			putchar(' ');
+			lbuf_putc(out, ' ');
 		}
 	}
-	putchar(close);
+	lbuf_putc(out, close);
 }
 
 /* Print a list value */
 
 void lval_print(lval* v) {
-	switch (v->type) {
+	lbuf* out = lval_stream();
+	switch (ltype(v)) {
 		case LVAL_NUM:
-			printf("%li", v->num);
+			lbuf_putnum(out, lnum(v));
 			break;
 		case LVAL_BOOL:
-			printf("%s", (v->num) ? "true" : "false");
+			lbuf_puts(out, (lnum(v)) ? "true" : "false");
 			break;
 		case LVAL_ERR:
-			printf("Error: %s", v->err);
+			lbuf_puts(out, "Error: ");
+			lbuf_puts(out, v->err);
 			break;
 		case LVAL_SYM:
-			printf("%s", v->sym);
+			lbuf_puts(out, v->sym);
 			break;
 		case LVAL_SEXPR:
 			lval_expr_print(v, '(', ')');
@@ -485,15 +1730,53 @@ void lval_print(lval* v) {
 		case LVAL_QEXPR:
 			lval_expr_print(v, '{', '}');
 			break;
+		case LVAL_PROMISE:
+			lbuf_puts(out, "<promise>");
+			break;
+		case LVAL_VEC:
+			lbuf_putc(out, '[');
+			for (int i = 0; i < v->vcount; i++) {
+				if (i) {
+					lbuf_putc(out, ' ');
+				}
+				lbuf_putnum(out, v->vdata[i]);
+			}
+			lbuf_putc(out, ']');
+			break;
+		case LVAL_MAP:
+			lbuf_puts(out, "(map");
+			for (int i = 0; i < v->mlen; i++) {
+				if (lmap_live(v, i)) {
+					lbuf_putc(out, ' ');
+					lval_print(lmap_store(v)->mkeys[i]);
+					lbuf_putc(out, ' ');
+					lval_print(lmap_store(v)->mvals[i]);
+				}
+			}
+			lbuf_putc(out, ')');
+			break;
 		case LVAL_FUN:
-			if (v->builtin) {
-				printf("<built-in function '%s'>", v->sym);
+			if (v->memo) {
+				lbuf_puts(out, "(memo ");
+				lval_print(v->memo->fn);
+				lbuf_putc(out, ')');
+			} else if (v->builtin) {
+				lbuf_puts(out, "<built-in function '");
+				lbuf_puts(out, v->name);
+				lbuf_puts(out, "'>");
 			} else {
-				printf("(\\ ");
-				lval_print(v->formals);
-				putchar(' ');
+				/* Only show the formals still to be bound */
+
+				lbuf_puts(out, "(\\ {");
+				for (int i = v->bound; i < v->formals->count; i++) {
+					lval_print(v->formals->cell[i]);
+					if (i != (v->formals->count - 1)) {
+						lbuf_putc(out, ' ');
+					}
+				}
+				lbuf_puts(out, "} ");
 				lval_print(v->body);
-				putchar(')');
+				lbuf_putc(out, ')');
 			}
 			break;
 	}
@@ -503,61 +1786,205 @@ void lval_print(lval* v) {
 
 void lval_println(lval* v) {
 	lval_print(v);
-	putchar('\n');
+	lbuf_newline(lval_stream());
+}
+
+/* Hash an interned symbol by its address */
+
+unsigned long lenv_hash(char* sym) {
+	unsigned long h = (unsigned long) (uintptr_t) sym;
+	return (h >> 4) * 2654435761UL;
+}
+
+/* Find the position of a symbol in an environment or -1 if it isn't defined */
+
+int lenv_find(lenv* e, char* sym, unsigned long hash) {
+
+	if (e->slots == 0) {
+		return -1;
+	}
+
+	/* Probe linearly from the home slot until the symbol or an empty slot is found */
+
+	int mask = e->slots - 1;
+	for (int s = hash & mask; e->index[s] != -1; s = (s + 1) & mask) {
+		int i = e->index[s];
+		if (e->syms[i] == sym) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Rebuild the hash index of an environment with room for at least 'slots' entries */
+
+void lenv_reindex(lenv* e, int slots) {
+
+	llim_charge(sizeof(int) * (slots - e->slots));
+	e->slots = slots;
+	e->index = realloc(e->index, sizeof(int) * slots);
+	for (int s = 0; s < slots; s++) {
+		e->index[s] = -1;
+	}
+
+	int mask = slots - 1;
+	for (int i = 0; i < e->count; i++) {
+		int s = e->hashes[i] & mask;
+		while (e->index[s] != -1) {
+			s = (s + 1) & mask;
+		}
+		e->index[s] = i;
+	}
+}
+
+/* Find the position of a bound formal argument or -1
+ *
+ * The search runs from the last formal so that, as when binding one at a time,
+ * a repeated formal name refers to the last value given.
+ */
+
+int lenv_find_arg(lenv* e, char* sym) {
+	for (int i = e->nargs - 1; i >= 0; i--) {
+		if ((e->arg_syms[i] == sym) && e->args[i]) {
+			return i;
+		}
+	}
+	return -1;
 }
 
+/* The caller's environment as seen from a worker of the parallel builtins (see pmap) */
+
+#ifdef LISPY_THREADS
+static _Thread_local lenv* lpar_shared = NULL;
+#endif
+
 /* Retrieve an environment value */
 
 lval* lenv_get(lenv* e, lval* k) {
 
-	/* Iterate over all items in environment returning a copy of the value if
-	 * the stored string matches; otherwise, return an error.
+	/* Hash the symbol once and then check each environment up the parent chain
+	 * returning a shared reference to the value if found; otherwise, return an error.
 	 */
 
-	for (int i = 0; i < e->count; i++) {
-	    if (strcmp(e->syms[i], k->sym) == 0) {
-	    	return lval_copy(e->vals[i]);
-	    }
+	unsigned long hash = lenv_hash(k->sym);
+
+	while (e) {
+		int i = lenv_find_arg(e, k->sym);
+		if (i != -1) {
+			return lval_ref(e->args[i]);
+		}
+		i = lenv_find(e, k->sym, hash);
+		if (i != -1) {
+			return lval_ref(e->vals[i]);
+		}
+		e = e->par;
 	}
 
-	/* If no symbol then recursively check the parent environments; otherwise, error */
+	/* Parallel workers fall back on a private clone of what the caller can see */
 
-	if (e->par) {
-		return lenv_get(e->par, k);
-	} else {
-		return lval_err("unbound symbol '%s'!", k->sym);
+#ifdef LISPY_THREADS
+	if (lpar_shared) {
+		return lpar_lookup(k, hash);
+	}
+#endif
+
+	return lval_err("unbound symbol '%s'!", k->sym);
+
+}
+
+/* The global environment evaluation in this thread ends at, when inline caches may be used */
+
+static _Thread_local lenv* lenv_root = NULL;
+
+/* Retrieve an environment value for a call site, filling its inline cache
+ *
+ * A symbol never bound outside a global environment can only be found in the
+ * root, so the search up the parent chain is skipped.
+ */
+
+lval* lenv_get_cached(lenv* e, lval* k, lcache* ic) {
+
+	if (!lenv_root || lsym_is_local(k->sym)) {
+		return lenv_get(e, k);
+	}
+
+	int i = lenv_find(lenv_root, k->sym, lenv_hash(k->sym));
+	if (i == -1) {
+		return lenv_get(e, k);
 	}
 
+	ic->version = lenv_root->version;
+	ic->value   = lenv_root->vals[i];
+
+	return lval_ref(ic->value);
 }
 
 /* Add a variable to an environment */
 
 void lenv_put(lenv* e, lval* k, lval* v) {
 
-	/* Iterate over all items in environment to see if variable already exists
-	 * and if a variable is found, delete the item in that position replacing it
-     * with the variable supplied by the user.
+	/* A change to a global environment invalidates the caches of its values */
+
+	if (e->version) {
+		e->version = lenv_next_version();
+	} else {
+		lsym_set_local(k->sym);
+	}
+
+	/* If the variable already exists, delete the item in that position replacing
+	 * it with the variable supplied by the user.
    	 */
 
-   	for (int i = 0; i < e->count; i++) {
-    	if (strcmp(e->syms[i], k->sym) == 0) {
-      		lval_del(e->vals[i]);
-      		e->vals[i] = lval_copy(v);
-      		return;
-    	}
-  	}
+	int i = lenv_find_arg(e, k->sym);
+
+	if (i != -1) {
+		lval_ref(v);
+		lval_del(e->args[i]);
+		e->args[i] = v;
+		return;
+	}
+
+	unsigned long hash = lenv_hash(k->sym);
+	i = lenv_find(e, k->sym, hash);
+
+	if (i != -1) {
+		lval_ref(v);
+		lval_del(e->vals[i]);
+		e->vals[i] = v;
+		return;
+	}
+
+	/* If no existing entry found then make space for a new entry, doubling the
+	 * arrays as needed and keeping the index no more than half full.
+	 */
 
-	/* If no existing entry found then allocate space for new entry */
+	if (e->count == e->size) {
+		llim_charge(-lenv_bytes(e));
+		e->size   = (e->size) ? e->size * 2 : 8;
+		e->vals   = realloc(e->vals,   sizeof(lval*) * e->size);
+		e->syms   = realloc(e->syms,   sizeof(char*) * e->size);
+		e->hashes = realloc(e->hashes, sizeof(unsigned long) * e->size);
+		llim_charge(lenv_bytes(e));
+	}
 
-	e->count++;
-	e->vals  = realloc(e->vals,  sizeof(lval*) * e->count);
-	e->syms  = realloc(e->syms,  sizeof(char*) * e->count);
+	/* Share the lval and the interned symbol in the new location */
 
-	/* Copy contents of lval and symbol string into new location */
+	i = e->count++;
+	e->vals[i]   = lval_ref(v);
+	e->syms[i]   = k->sym;
+	e->hashes[i] = hash;
 
-	e->vals[e->count-1]  = lval_copy(v);
-	e->syms[e->count-1]  = malloc(strlen(k->sym)+1);
-	strcpy(e->syms[e->count-1], k->sym);
+	if (e->count * 2 > e->slots) {
+		lenv_reindex(e, (e->slots) ? e->slots * 2 : 16);
+	} else {
+		int mask = e->slots - 1;
+		int s = hash & mask;
+		while (e->index[s] != -1) {
+			s = (s + 1) & mask;
+		}
+		e->index[s] = i;
+	}
 
 }
 
@@ -577,33 +2004,67 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 /* Copy an environment */
 
 lenv* lenv_copy(lenv* e) {
-	lenv* n = malloc(sizeof(lenv));
-	n->par = e->par;
-	n->count = e->count;
-	n->syms = malloc(sizeof(char*) * n->count);
-	n->vals = malloc(sizeof(lval*) * n->count);
-	for (int i = 0; i < e->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
+	lenv* n = lenv_frame(e->nargs, e->arg_syms);
+	llim_charge(-lenv_bytes(n));
+	n->par    = e->par;
+	n->count  = e->count;
+	n->size   = e->count;
+	n->slots  = e->slots;
+	n->syms   = NULL;
+	n->vals   = NULL;
+	n->hashes = NULL;
+	n->index  = NULL;
+	if (n->count) {
+		n->syms   = malloc(sizeof(char*) * n->count);
+		n->vals   = malloc(sizeof(lval*) * n->count);
+		n->hashes = malloc(sizeof(unsigned long) * n->count);
+		for (int i = 0; i < e->count; i++) {
+			n->syms[i]   = e->syms[i];
+			n->vals[i]   = lval_ref(e->vals[i]);
+			n->hashes[i] = e->hashes[i];
+		}
+		n->index = malloc(sizeof(int) * n->slots);
+		memcpy(n->index, e->index, sizeof(int) * n->slots);
+	}
+	llim_charge(lenv_bytes(n));
+	for (int i = 0; i < n->nargs; i++) {
+		n->args[i] = (e->args[i]) ? lval_ref(e->args[i]) : NULL;
 	}
 	return n;
 }
 
-/* Call a function */
+/* Select between running lambda bodies as bytecode or by walking the tree */
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+static bool lval_use_vm = true;
 
-	/* If Builtin then simply apply that */
+/* Bind arguments to the formals of a lambda in a new frame
+ *
+ * The lambda itself is left untouched: the frame starts with any arguments
+ * bound by earlier partial application.  Returns NULL once every formal is
+ * bound with the frame ready for evaluating the body; otherwise the result of
+ * the call, either an error or the partially applied function which keeps the
+ * frame as its environment.
+ */
 
-	if (f->builtin) {
-		return f->builtin(e, a);
-	}
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame) {
 
 	/* Record Argument Counts */
 
+	lval** formals = f->formals->cell;
+	int    nargs   = f->formals->count;
+	int    bound   = f->bound;
+
 	int given = a->count;
-	int total = f->formals->count;
+	int total = nargs - bound;
+
+	/* Start a frame from the arguments already bound */
+
+	lenv*  n    = lenv_frame(nargs, f->env->arg_syms);
+	lval** args = n->args;
+
+	for (int i = 0; i < bound; i++) {
+		args[i] = (f->env->args[i]) ? lval_ref(f->env->args[i]) : NULL;
+	}
 
 	/* While arguments still remain to be processed */
 
@@ -611,48 +2072,35 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 		/* If we've ran out of formal arguments to bind */
 
-		if (f->formals->count == 0) {
+		if (bound == nargs) {
 			lval_del(a);
+			lenv_del(n);
 			return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, total);
 		}
 
-		/* Pop the first symbol from the formals */
-
-		lval* sym = lval_pop(f->formals, 0);
-
 		/* Special case to deal with the '&' symbol */
 
-		if (strcmp(sym->sym, "&") == 0) {
+		if (formals[bound]->sym == lsym_amp) {
 
 			/* Ensure '&' is followed by another symbol */
 
-			if (f->formals->count != 1) {
+			if (nargs - bound != 2) {
 				lval_del(a);
+				lenv_del(n);
 				return lval_err("Function format invalid. Symbol '&' not followed by another symbol.");
 			}
 
 			/* Next formal should be bound to the remaining arguments */
 
-			lval* nsym = lval_pop(f->formals, 0);
-			lenv_put(f->env, nsym, builtin_list(e, a));
-			lval_del(sym);
-			lval_del(nsym);
+			args[bound + 1] = lval_ref(builtin_list(e, a));
+			bound = nargs;
 			break;
 
 		}
 
-		/* Pop the next argument from the list */
-
-		lval* val = lval_pop(a, 0);
-
-		/* Bind a copy into the function's environment */
-
-		lenv_put(f->env, sym, val);
-
-		/* Delete symbol and value */
+		/* Bind the next argument to the next formal's position */
 
-		lval_del(sym);
-		lval_del(val);
+		args[bound++] = lval_pop(a, 0);
 	}
 
 	/* Argument list is now bound so can be cleaned up */
@@ -661,90 +2109,590 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 	/* If '&' remains in formal list it should be bound to empty list */
 
-	if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+	if (bound < nargs && formals[bound]->sym == lsym_amp) {
 
 		/* Check to ensure that & is not passed invalidly. */
 
-		if (f->formals->count != 2) {
+		if (nargs - bound != 2) {
+			lenv_del(n);
 			return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
 		}
 
-		/* Pop and delete '&' symbol */
-
-		lval_del(lval_pop(f->formals, 0));
-
-		/* Pop next symbol and create empty list */
-
-		lval* sym = lval_pop(f->formals, 0);
-		lval* val = lval_qexpr();
-
-		/* Bind to environment and delete */
-
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+		args[bound + 1] = lval_qexpr();
+		bound = nargs;
 	}
 
-	/* If all formals have been bound evaluate */
+	/* If all formals have been bound the body can be evaluated */
 
-	if (f->formals->count == 0) {
+	if (bound == nargs) {
+		*frame = n;
+		return NULL;
+	}
 
-		/* Set Function Environment parent to current evaluation Environment */
+	/* Otherwise return a partially evaluated function sharing everything but the frame */
 
-		f->env->par = e;
+	lval* p = lpool_alloc(&lval_pool);
+	p->type    = LVAL_FUN;
+	p->refs    = 1;
+	p->builtin = NULL;
+	p->name    = NULL;
+	p->code    = f->code;
+	p->code->refs++;
+	p->bound   = bound;
+	p->special = false;
+	p->memo    = NULL;
+	p->env     = n;
+	p->formals = lval_ref(f->formals);
+	p->body    = lval_ref(f->body);
 
-		/* Evaluate and return */
+	return p;
 
-		return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+}
 
-	} else {
+/* Evaluate the body of a lambda in a frame binding all of its formals
+ *
+ * A call in tail position is not made but handed back through 'tail' as the
+ * s-expression of the function and its arguments, in which case NULL is
+ * returned.
+ */
 
-		/* Otherwise return partially evaluated function */
+lval* lval_body_eval(lval* f, lenv* frame, lval** tail) {
 
-		return lval_copy(f);
+	/* Run the compiled body unless tree walking */
 
+	if (lval_use_vm) {
+		return lvm_run(frame, f->code, tail);
 	}
 
-}
+	lval* x = lval_copy(f->body);
+	x->type = LVAL_SEXPR;
 
-/* Evalate an s-expresssion */
+	return lval_eval_sexpr_tail(frame, x, tail);
+}
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+/* Test whether a frame hides every binding of the frame it is called from
+ *
+ * A call frame that binds all the formals its caller's frame binds, when the
+ * caller has no other local variables, makes the caller's frame unobservable:
+ * any lookup passing through one would be answered by the other first.
+ */
 
-	/* Evaluate children */
+bool lenv_shadows(lenv* inner, lenv* outer) {
 
-	for (int i = 0; i < v->count; i++) {
-		v->cell[i] = lval_eval(e, v->cell[i]);
+	if (outer->count) {
+		return false;
 	}
 
-	/* Error checking */
+	if (inner->arg_syms == outer->arg_syms) {
+		return true;
+	}
 
-	for (int i = 0; i < v->count; i++) {
-		if (v->cell[i]->type == LVAL_ERR) {
-			return lval_take(v, i);
+	for (int i = 0; i < outer->nargs; i++) {
+		if (outer->args[i] && (lenv_find_arg(inner, outer->arg_syms[i]) == -1)) {
+			return false;
 		}
 	}
 
-	/* Empty expression */
+	return true;
+}
 
-	if (v->count == 0) {
+/* Profiler
+ *
+ * When enabled, lval_call records every call of a builtin or lambda in a call
+ * tree with one node per distinct stack of function names. Each node counts
+ * its calls and the time and pool allocations spent in it but not in its
+ * callees. Lambdas are named after the symbol they were first defined as, and
+ * a call in tail position replaces its caller on the stack as it does at run
+ * time. The report, written to stderr at exit, is either a flat table per
+ * function or folded stacks ("outer;inner self-microseconds") for flame graphs.
+ */
+
+typedef struct lprof_node {
+	char*              name;      // function name
+	struct lprof_node* parent;
+	struct lprof_node* child;     // first callee
+	struct lprof_node* sibling;   // next callee of the parent
+	long               calls;
+	long               self_ns;   // time not spent in callees
+	long               allocs;    // allocations not made by callees
+} lprof_node;
+
+typedef struct lprof_frame {
+	lprof_node* node;
+	long        start_ns;
+	long        start_allocs;
+	long        child_ns;         // time spent in callees so far
+	long        child_allocs;     // allocations made by callees so far
+} lprof_frame;
+
+enum { LPROF_OFF, LPROF_FLAT, LPROF_FOLDED };
+
+/* Profiling is per thread, so is left off in the workers of the parallel builtins */
+
+static _Thread_local int          lprof_mode  = LPROF_OFF;
+static _Thread_local lprof_node   lprof_root  = { "" };
+static _Thread_local lprof_frame* lprof_stack = NULL;
+static _Thread_local int          lprof_depth = 0;
+static _Thread_local int          lprof_size  = 0;
+
+/* Read a monotonic-enough wall clock in nanoseconds */
+
+static long ltime_nsec(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (long) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline long lprof_allocs(void) {
+	return lval_pool.allocs + lenv_pool.allocs;
+}
+
+/* Start timing a call of the named function from the innermost call */
+
+void lprof_enter(char* name) {
+
+	if (!name) {
+		name = "<lambda>";
+	}
+
+	lprof_node* parent = (lprof_depth) ? lprof_stack[lprof_depth-1].node : &lprof_root;
+
+	lprof_node* n = parent->child;
+	while (n && (n->name != name)) {
+		n = n->sibling;
+	}
+	if (!n) {
+		n = calloc(1, sizeof(lprof_node));
+		n->name    = name;
+		n->parent  = parent;
+		n->sibling = parent->child;
+		parent->child = n;
+	}
+	n->calls++;
+
+	if (lprof_depth == lprof_size) {
+		lprof_size  = (lprof_size) ? lprof_size * 2 : 64;
+		lprof_stack = realloc(lprof_stack, sizeof(lprof_frame) * lprof_size);
+	}
+
+	lprof_frame* f = &lprof_stack[lprof_depth++];
+	f->node         = n;
+	f->child_ns     = 0;
+	f->child_allocs = 0;
+	f->start_allocs = lprof_allocs();
+	f->start_ns     = ltime_nsec();
+}
+
+/* Finish timing the innermost call, charging its total to its caller */
+
+void lprof_exit(void) {
+
+	long now = ltime_nsec();
+
+	lprof_frame* f = &lprof_stack[--lprof_depth];
+	long ns     = now - f->start_ns;
+	long allocs = lprof_allocs() - f->start_allocs;
+
+	f->node->self_ns += ns - f->child_ns;
+	f->node->allocs  += allocs - f->child_allocs;
+
+	if (lprof_depth) {
+		lprof_stack[lprof_depth-1].child_ns     += ns;
+		lprof_stack[lprof_depth-1].child_allocs += allocs;
+	}
+}
+
+/* Per function totals for the flat report */
+
+typedef struct lprof_total {
+	char* name;
+	long  calls;
+	long  self_ns;
+	long  total_ns;
+	long  allocs;
+} lprof_total;
+
+/* Add up a subtree, returning its inclusive time */
+
+static long lprof_sum(lprof_node* n, lprof_total** totals, int* count) {
+
+	long ns = n->self_ns;
+	for (lprof_node* c = n->child; c; c = c->sibling) {
+		ns += lprof_sum(c, totals, count);
+	}
+
+	int i = 0;
+	while ((i < *count) && ((*totals)[i].name != n->name)) {
+		i++;
+	}
+	if (i == *count) {
+		*totals = realloc(*totals, sizeof(lprof_total) * (*count + 1));
+		(*totals)[i] = (lprof_total) { n->name, 0, 0, 0, 0 };
+		(*count)++;
+	}
+
+	(*totals)[i].calls   += n->calls;
+	(*totals)[i].self_ns += n->self_ns;
+	(*totals)[i].allocs  += n->allocs;
+
+	/* Recursive calls are already included in the outermost call's time */
+
+	bool outermost = true;
+	for (lprof_node* p = n->parent; p; p = p->parent) {
+		if (p->name == n->name) {
+			outermost = false;
+			break;
+		}
+	}
+	if (outermost) {
+		(*totals)[i].total_ns += ns;
+	}
+
+	return ns;
+}
+
+static int lprof_by_self(const void* x, const void* y) {
+	long a = ((lprof_total*) x)->self_ns;
+	long b = ((lprof_total*) y)->self_ns;
+	return (a < b) - (a > b);
+}
+
+/* Print the stack leading to each node followed by its self time */
+
+static void lprof_fold(lprof_node* n, char** path, int depth) {
+
+	path[depth] = n->name;
+
+	if (n->self_ns / 1000) {
+		for (int i = 0; i <= depth; i++) {
+			fprintf(stderr, (i) ? ";%s" : "%s", path[i]);
+		}
+		fprintf(stderr, " %li\n", n->self_ns / 1000);
+	}
+
+	for (lprof_node* c = n->child; c; c = c->sibling) {
+		lprof_fold(c, path, depth + 1);
+	}
+}
+
+static int lprof_height(lprof_node* n) {
+	int h = 0;
+	for (lprof_node* c = n->child; c; c = c->sibling) {
+		int d = lprof_height(c);
+		h = (d > h) ? d : h;
+	}
+	return h + 1;
+}
+
+static void lprof_free(lprof_node* n) {
+	lprof_node* c = n->child;
+	while (c) {
+		lprof_node* next = c->sibling;
+		lprof_free(c);
+		free(c);
+		c = next;
+	}
+}
+
+/* Write the report to stderr and release the call tree */
+
+void lprof_report(void) {
+
+	if (lprof_mode == LPROF_FOLDED) {
+
+		char** path = malloc(sizeof(char*) * lprof_height(&lprof_root));
+		for (lprof_node* c = lprof_root.child; c; c = c->sibling) {
+			lprof_fold(c, path, 0);
+		}
+		free(path);
+
+	} else if (lprof_mode == LPROF_FLAT) {
+
+		lprof_total* totals = NULL;
+		int count = 0;
+		for (lprof_node* c = lprof_root.child; c; c = c->sibling) {
+			lprof_sum(c, &totals, &count);
+		}
+		qsort(totals, count, sizeof(lprof_total), lprof_by_self);
+
+		fprintf(stderr, "%10s %12s %12s %12s  %s\n", "calls", "total-ms", "self-ms", "allocs", "function");
+		for (int i = 0; i < count; i++) {
+			fprintf(stderr, "%10li %12.3f %12.3f %12li  %s\n", totals[i].calls,
+				totals[i].total_ns / 1e6, totals[i].self_ns / 1e6, totals[i].allocs, totals[i].name);
+		}
+		free(totals);
+	}
+
+	lprof_free(&lprof_root);
+	lprof_root.child = NULL;
+	free(lprof_stack);
+	lprof_stack = NULL;
+	lprof_depth = lprof_size = 0;
+}
+
+/* Return the error for an exceeded limit, or NULL while within them all */
+
+lval* llim_check(void) {
+
+	if (llim_breach == LLIM_NONE) {
+		if (llim_max.steps && (llim_steps > llim_max.steps)) {
+			llim_breach = LLIM_STEPS;
+		} else if (llim_max.depth && (llim_depth > llim_max.depth)) {
+			llim_breach = LLIM_DEPTH;
+		} else if (llim_max.bytes && (llim_bytes() > llim_max.bytes)) {
+			llim_breach = LLIM_BYTES;
+		}
+	}
+
+	switch (llim_breach) {
+		case LLIM_STEPS:
+			return lval_err("Evaluation exceeded its limit of %li steps", llim_max.steps);
+		case LLIM_DEPTH:
+			return lval_err("Evaluation exceeded its limit of %li nested calls", llim_max.depth);
+		case LLIM_BYTES:
+			return lval_err("Evaluation exceeded its limit of %li bytes", llim_max.bytes);
+	}
+
+	return NULL;
+}
+
+/* Call a function
+ *
+ * Lambda calls run on a trampoline: a call in tail position of the body
+ * returns to this loop, which binds and evaluates the next function without
+ * growing the C stack.  Each call gets a fresh frame whose parent is the
+ * caller's environment, so the frames form a chain back to 'e' which is
+ * released once the whole chain returns.  When the next frame shadows the
+ * current one completely (as in self recursion) the current frame is released
+ * straight away instead.
+ */
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+
+	/* Each call is a step, and fails once over a limit */
+
+	llim_steps++;
+	if (llim_on) {
+		lval* err = llim_check();
+		if (err) {
+			lval_del(a);
+			return err;
+		}
+	}
+
+	/* If Builtin then simply apply that */
+
+	if (f->builtin) {
+		if (f->memo) {
+			return lmemo_call(e, f->memo, a);
+		}
+		if (lprof_mode) {
+			lprof_enter(f->name);
+			lval* result = f->builtin(e, a);
+			lprof_exit();
+			return result;
+		}
+		return f->builtin(e, a);
+	}
+
+	lenv* frame;
+	lval* result = lval_bind(e, f, a, &frame);
+	if (result) {
+		return result;
+	}
+
+	if (++llim_depth > llim_peak) {
+		llim_peak = llim_depth;
+	}
+	if (llim_on && (result = llim_check())) {
+		llim_depth--;
+		lenv_del(frame);
+		return result;
+	}
+
+	if (lprof_mode) {
+		lprof_enter(f->code->name);
+	}
+
+	/* Set the frame's parent to the current evaluation Environment */
+
+	lenv* outer = e;
+	frame->par  = e;
+
+	bool owned  = false;          // whether we hold a reference to f rather than the caller
+
+	for (;;) {
+
+		/* Evaluate, stopping unless a tail call is handed back */
+
+		lval* next = NULL;
+		result = lval_body_eval(f, frame, &next);
+		if (result) {
+			break;
+		}
+
+		/* Bind the function called in tail position */
+
+		lval* g = lval_pop(next, 0);
+		lenv* n;
+		result = lval_bind(frame, g, next, &n);
+		if (result) {
+			lval_del(g);
+			break;
+		}
+
+		/* Drop the current frame when the new one hides it, otherwise chain onto it */
+
+		if (lenv_shadows(n, frame)) {
+			n->par = frame->par;
+			lenv_del(frame);
+		} else {
+			n->par = frame;
+		}
+
+		if (owned) {
+			lval_del(f);
+		}
+
+		/* The tail call takes the place of the current one on the profile stack */
+
+		if (lprof_mode) {
+			lprof_exit();
+			lprof_enter(g->code->name);
+		}
+
+		f     = g;
+		frame = n;
+		owned = true;
+
+		/* A tail call is a step too */
+
+		llim_steps++;
+		if (llim_on && (result = llim_check())) {
+			break;
+		}
+	}
+
+	llim_depth--;
+
+	if (lprof_mode) {
+		lprof_exit();
+	}
+
+	/* Release the frames of the chain */
+
+	while (frame != outer) {
+		lenv* par = frame->par;
+		lenv_del(frame);
+		frame = par;
+	}
+
+	if (owned) {
+		lval_del(f);
+	}
+
+	return result;
+
+}
+
+/* Evalate an s-expresssion */
+
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+	return lval_eval_sexpr_tail(e, v, NULL);
+}
+
+/* Evaluate an s-expression which may be in tail position (see lval_body_eval)
+ *
+ * When the expression is a call of the built-in 'if' the selected branch is
+ * evaluated by looping rather than recursing.
+ */
+
+lval* lval_eval_sexpr_tail(lenv* e, lval* v, lval** tail) {
+
+	for (;;) {
+
+		/* Evaluation replaces the children in place so take a private copy if shared */
+
+		v = lval_own(v);
+
+		/* Evaluate children, handing them over unevaluated when the first is a special form */
+
+		v->hash = 0;
+		for (int i = 0; i < v->count; i++) {
+			v->cell[i] = lval_eval(e, v->cell[i]);
+
+			if ((i == 0) && (ltype(v->cell[0]) == LVAL_FUN) && v->cell[0]->special) {
+				lval* f = lval_pop(v, 0);
+				lval* x = lval_call(e, f, v);
+				lval_del(f);
+				return x;
+			}
+		}
+
+		/* Continue with the branch when this is a valid call of built-in 'if' */
+
+		if ((v->count == 4) &&
+			(ltype(v->cell[0]) == LVAL_FUN) && (v->cell[0]->builtin == builtin_if) &&
+			(ltype(v->cell[1]) == LVAL_NUM) &&
+			(ltype(v->cell[2]) == LVAL_QEXPR) && (ltype(v->cell[3]) == LVAL_QEXPR)) {
+
+			lval* x = lval_own(lval_pop(v, (lnum(v->cell[1])) ? 2 : 3));
+			x->type = LVAL_SEXPR;
+			lval_del(v);
+			v = x;
+			continue;
+		}
+
+		return lval_apply_tail(e, v, tail);
+	}
+
+}
+
+/* Apply an s-expression whose children have already been evaluated */
+
+lval* lval_apply(lenv* e, lval* v) {
+	return lval_apply_tail(e, v, NULL);
+}
+
+/* Apply an s-expression which may be in tail position (see lval_body_eval) */
+
+lval* lval_apply_tail(lenv* e, lval* v, lval** tail) {
+
+	/* Error checking */
+
+	for (int i = 0; i < v->count; i++) {
+		if (ltype(v->cell[i]) == LVAL_ERR) {
+			return lval_take(v, i);
+		}
+	}
+
+	/* Empty expression */
+
+	if (v->count == 0) {
 		return v;
 	}
 
 	/* Single expresssion */
 
-	if ((v->count == 1) && (v->cell[0]->type != LVAL_FUN)) {
+	if ((v->count == 1) && (ltype(v->cell[0]) != LVAL_FUN)) {
 		return lval_take(v, 0);
 	}
 
+	/* Hand a lambda call in tail position back to the trampoline in lval_call */
+
+	if (tail && (ltype(v->cell[0]) == LVAL_FUN) && !v->cell[0]->builtin) {
+		*tail = v;
+		return NULL;
+	}
+
 	/* Ensure the first element is a fucntion after evaluation */
 
 	lval* f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN) {
+	if (ltype(f) != LVAL_FUN) {
 
 		lval* err = lval_err(
 			"S-expression starts with incorrect type. Got %s, Expected %s",
-			ltype_name(f->type), ltype_name(LVAL_FUN));
+			ltype_name(ltype(f)), ltype_name(LVAL_FUN));
 
 		lval_del(f);
 		lval_del(v);
@@ -766,490 +2714,3901 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
 
 lval* lval_eval(lenv* e, lval* v) {
 
-	if (v->type == LVAL_SYM) {
+	if (ltype(v) == LVAL_SYM) {
 		lval* x = lenv_get(e, v);
 		lval_del(v);
 		return x;
 	}
 	
-	if (v->type == LVAL_SEXPR) {
+	if (ltype(v) == LVAL_SEXPR) {
 		return lval_eval_sexpr(e, v);
 	}
 
-	return v;
-}
+	return v;
+}
+
+/* Append an instruction word returning its position */
+
+int lcode_emit(lcode* c, int op) {
+	if (c->count == c->size) {
+		c->size = (c->size) ? c->size * 2 : 32;
+		c->ops  = realloc(c->ops, sizeof(int) * c->size);
+	}
+	c->ops[c->count] = op;
+	return c->count++;
+}
+
+/* Add a shared reference to a constant returning its index */
+
+int lcode_const(lcode* c, lval* x) {
+	if (c->nconsts == c->csize) {
+		c->csize  = (c->csize) ? c->csize * 2 : 8;
+		c->consts = realloc(c->consts, sizeof(lval*) * c->csize);
+	}
+	c->consts[c->nconsts] = lval_ref(x);
+	return c->nconsts++;
+}
+
+/* Add an empty inline cache returning its index */
+
+int lcode_cache(lcode* c) {
+	if ((c->ncaches & (c->ncaches - 1)) == 0) {
+		c->caches = realloc(c->caches, sizeof(lcache) * ((c->ncaches) ? c->ncaches * 2 : 1));
+	}
+	c->caches[c->ncaches].version = 0;
+	c->caches[c->ncaches].value   = NULL;
+	return c->ncaches++;
+}
+
+/* Track the stack depth as values are pushed and popped */
+
+void lcode_push(lcode* c, int n) {
+	c->depth += n;
+	if (c->depth > c->max_depth) {
+		c->max_depth = c->depth;
+	}
+}
+
+void lcode_sexpr(lcode* c, lval* x, bool tail);
+void lcode_call(lcode* c, lval* x, bool tail);
+
+/* Evaluate an s-expression made only of pure builtin calls on constants
+ *
+ * Returns the value, or NULL when the expression cannot be folded.  Each
+ * operator symbol the value depends on is added to 'guards' with the builtin
+ * it names, unless it is a formal of the lambda being compiled.
+ */
+
+lval* lcode_fold(lcode* c, lval* x, lval* guards) {
+
+	if ((x->count < 2) || (ltype(x->cell[0]) != LVAL_SYM)) {
+		return NULL;
+	}
+
+	char* sym = x->cell[0]->sym;
+	for (int i = 0; i < c->nargs; i++) {
+		if (c->arg_syms[i] == sym) {
+			return NULL;
+		}
+	}
+
+	lbuiltin fn = lbuiltin_pure(sym);
+	if (!fn) {
+		return NULL;
+	}
+
+	/* Every argument must be a number, a boolean or itself foldable */
+
+	lval* a = lval_sexpr();
+	for (int i = 1; i < x->count; i++) {
+		lval* y = x->cell[i];
+		if ((ltype(y) == LVAL_NUM) || (ltype(y) == LVAL_BOOL)) {
+			y = lval_ref(y);
+		} else if (ltype(y) == LVAL_SEXPR) {
+			y = lcode_fold(c, y, guards);
+		} else {
+			y = NULL;
+		}
+		if (!y) {
+			lval_del(a);
+			return NULL;
+		}
+		lval_add(a, y);
+	}
+
+	/* The pure builtins never look at their environment */
+
+	lval* r = fn(NULL, a);
+	if (ltype(r) == LVAL_ERR) {
+		lval_del(r);
+		return NULL;
+	}
+
+	for (int i = 0; i < guards->count; i += 2) {
+		if (guards->cell[i]->sym == sym) {
+			return r;
+		}
+	}
+	lval_add(guards, lval_ref(x->cell[0]));
+	lval* f = lval_fun(fn);
+	f->name = sym;
+	lval_add(guards, f);
+
+	return r;
+}
+
+/* Compile an expression leaving its value on the stack */
+
+void lcode_expr(lcode* c, lval* x) {
+	switch (ltype(x)) {
+		case LVAL_SYM:
+
+			/* Formals are found by position, searching from the last as lenv_find_arg does */
+
+			for (int i = c->nargs - 1; i >= 0; i--) {
+				if (c->arg_syms[i] == x->sym) {
+					lcode_emit(c, LOP_LOCAL);
+					lcode_emit(c, i);
+					lcode_push(c, 1);
+					return;
+				}
+			}
+
+			lcode_emit(c, LOP_LOAD);
+			lcode_emit(c, lcode_const(c, x));
+			lcode_emit(c, lcode_cache(c));
+			lcode_push(c, 1);
+			break;
+		case LVAL_SEXPR:
+			lcode_sexpr(c, x, false);
+			break;
+		default:
+			lcode_emit(c, LOP_CONST);
+			lcode_emit(c, lcode_const(c, x));
+			lcode_push(c, 1);
+			break;
+	}
+}
+
+/* Compile the elements of an expression as an s-expression, noting whether
+ * its value is the value of the whole body.
+ */
+
+void lcode_sexpr(lcode* c, lval* x, bool tail) {
+
+	/* Inline both branches of (if c {then} {else}) */
+
+	if ((x->count == 4) && (ltype(x->cell[0]) == LVAL_SYM) && (x->cell[0]->sym == lsym_if) &&
+		(ltype(x->cell[2]) == LVAL_QEXPR) && (ltype(x->cell[3]) == LVAL_QEXPR)) {
+
+		lcode_expr(c, x->cell[0]);
+		lcode_expr(c, x->cell[1]);
+
+		lcode_emit(c, LOP_IF);
+		lcode_emit(c, lcode_const(c, x->cell[2]));
+		lcode_emit(c, lcode_const(c, x->cell[3]));
+		int jelse = lcode_emit(c, 0);
+		int jend  = lcode_emit(c, 0);
+
+		/* Falling back to an ordinary call pushes both branches and applies all four */
+
+		lcode_push(c, 2);
+		c->depth -= 4;
+
+		lcode_sexpr(c, x->cell[2], tail);
+		c->depth--;
+		lcode_emit(c, LOP_JUMP);
+		int jthen = lcode_emit(c, 0);
+
+		c->ops[jelse] = c->count;
+		lcode_sexpr(c, x->cell[3], tail);
+
+		c->ops[jthen] = c->count;
+		c->ops[jend]  = c->count;
+		return;
+	}
+
+	/* Fold a pure expression on constants, compiling the ordinary call to
+	   fall back on should one of its operators have been rebound */
+
+	lval* guards = lval_qexpr();
+	lval* k = lcode_fold(c, x, guards);
+
+	if (k) {
+		lcode_emit(c, LOP_FOLD);
+		lcode_emit(c, lcode_const(c, k));
+		lcode_emit(c, lcode_cache(c));
+		lcode_emit(c, guards->count / 2);
+		int jend = lcode_emit(c, 0);
+		for (int i = 0; i < guards->count; i++) {
+			lcode_emit(c, lcode_const(c, guards->cell[i]));
+		}
+		lval_del(k);
+		lval_del(guards);
+
+		lcode_push(c, 1);
+		c->depth--;
+		lcode_call(c, x, tail);
+
+		c->ops[jend] = c->count;
+		return;
+	}
+
+	lval_del(guards);
+
+	lcode_call(c, x, tail);
+}
+
+/* Compile an ordinary call, evaluating every element and applying them */
+
+void lcode_call(lcode* c, lval* x, bool tail) {
+
+	int jend = -1;
+
+	for (int i = 0; i < x->count; i++) {
+		lcode_expr(c, x->cell[i]);
+
+		/* Once the first element is known, divert to a special form given the rest unevaluated */
+
+		if ((i == 0) && (x->count > 1)) {
+			lval* args = lval_sexpr();
+			for (int j = 1; j < x->count; j++) {
+				lval_add(args, lval_ref(x->cell[j]));
+			}
+			lcode_emit(c, LOP_FORM);
+			lcode_emit(c, lcode_const(c, args));
+			jend = lcode_emit(c, 0);
+			lval_del(args);
+		}
+	}
+
+	lcode_emit(c, (tail) ? LOP_TAILCALL : LOP_CALL);
+	lcode_emit(c, x->count);
+	c->depth -= x->count;
+	lcode_push(c, 1);
+
+	if (jend >= 0) {
+		c->ops[jend] = c->count;
+	}
+}
+
+/* Resolve the formals of a lambda and compile its Q-expression body */
+
+lcode* lcode_compile(lval* formals, lval* body) {
+
+	lcode* c = malloc(sizeof(lcode));
+	c->refs      = 1;
+	c->count     = 0;
+	c->size      = 0;
+	c->ops       = NULL;
+	c->nconsts   = 0;
+	c->csize     = 0;
+	c->consts    = NULL;
+	c->depth     = 0;
+	c->max_depth = 0;
+	c->name      = NULL;
+	c->mark      = 0;
+	c->ncaches   = 0;
+	c->caches    = NULL;
+
+	/* Give each formal a position, with '&' itself never bound to a value */
+
+	c->nargs    = formals->count;
+	c->arg_syms = malloc(sizeof(char*) * (c->nargs + 1));
+	for (int i = 0; i < c->nargs; i++) {
+		c->arg_syms[i] = (formals->cell[i]->sym == lsym_amp) ? NULL : formals->cell[i]->sym;
+		lsym_set_local(formals->cell[i]->sym);
+	}
+
+	lcode_sexpr(c, body, true);
+	lcode_emit(c, LOP_RETURN);
+
+	return c;
+}
+
+/* Release a reference to compiled code */
+
+void lcode_del(lcode* c) {
+
+	if (--c->refs > 0) {
+		return;
+	}
+
+	for (int i = 0; i < c->nconsts; i++) {
+		lval_del(c->consts[i]);
+	}
+	free(c->consts);
+	free(c->ops);
+	free(c->arg_syms);
+	free(c->caches);
+	free(c);
+}
+
+/* Apply n values taken from the stack (see lval_apply_tail) */
+
+lval* lvm_apply(lenv* e, lval** values, int n, lval** tail) {
+
+	lval* v = lval_sexpr();
+	if (n) {
+		lval_reserve(v, n);
+		memcpy(v->cell, values, sizeof(lval*) * n);
+		v->count = n;
+	}
+
+	return lval_apply_tail(e, v, tail);
+}
+
+/* Run compiled code in an environment, handing back a call in tail position
+ * as lval_body_eval describes.
+ */
+
+lval* lvm_run(lenv* e, lcode* c, lval** tail) {
+
+	lval* stack[c->max_depth + 2];
+	int   sp = 0;
+	int*  pc = c->ops;
+
+	for (;;) {
+		switch (*pc++) {
+
+			case LOP_CONST:
+				stack[sp++] = lval_ref(c->consts[*pc++]);
+				break;
+
+			case LOP_LOAD: {
+				lval*   k  = c->consts[pc[0]];
+				lcache* ic = &c->caches[pc[1]];
+				pc += 2;
+				if (lenv_root && (ic->version == lenv_root->version) && !lsym_is_local(k->sym)) {
+					stack[sp++] = lval_ref(ic->value);
+				} else {
+					stack[sp++] = lenv_get_cached(e, k, ic);
+				}
+				break;
+			}
+
+			case LOP_LOCAL:
+				stack[sp++] = lval_ref(e->args[*pc++]);
+				break;
+
+			case LOP_CALL: {
+				int n = *pc++;
+				sp -= n;
+				stack[sp] = lvm_apply(e, &stack[sp], n, NULL);
+				sp++;
+				break;
+			}
+
+			case LOP_TAILCALL: {
+				int n = *pc++;
+				sp -= n;
+				stack[sp] = lvm_apply(e, &stack[sp], n, tail);
+				if (!stack[sp]) {
+					return NULL;
+				}
+				sp++;
+				break;
+			}
+
+			case LOP_IF: {
+				lval* f    = stack[sp-2];
+				lval* cond = stack[sp-1];
+
+				if ((ltype(f) == LVAL_FUN) && (f->builtin == builtin_if) && (ltype(cond) == LVAL_NUM)) {
+
+					/* Continue into the inlined 'then' branch or jump to the 'else' branch */
+
+					bool taken = lnum(cond);
+					lval_del(f);
+					lval_del(cond);
+					sp -= 2;
+					pc = (taken) ? pc + 4 : c->ops + pc[2];
+
+				} else {
+
+					/* Otherwise apply whatever 'if' is bound to the condition and branches */
+
+					stack[sp++] = lval_ref(c->consts[pc[0]]);
+					stack[sp++] = lval_ref(c->consts[pc[1]]);
+					sp -= 4;
+					stack[sp] = lvm_apply(e, &stack[sp], 4, NULL);
+					sp++;
+					pc = c->ops + pc[3];
+				}
+				break;
+			}
+
+			case LOP_JUMP:
+				pc = c->ops + *pc;
+				break;
+
+			case LOP_FORM: {
+
+				/* Replace a special form by its result, otherwise go on to evaluate the arguments */
+
+				lval* f = stack[sp-1];
+
+				if ((ltype(f) == LVAL_FUN) && f->special) {
+					stack[sp-1] = lval_call(e, f, lval_copy(c->consts[pc[0]]));
+					lval_del(f);
+					pc = c->ops + pc[1];
+				} else {
+					pc += 2;
+				}
+				break;
+			}
+
+			case LOP_FOLD: {
+
+				/* Use the folded value only while every operator is still its builtin */
+
+				lcache* ic    = &c->caches[pc[1]];
+				int     n     = pc[2];
+				bool    valid = true;
+				bool    local = false;
+
+				for (int i = 0; i < n; i++) {
+					local |= lsym_is_local(c->consts[pc[4 + 2*i]]->sym);
+				}
+
+				if (!lenv_root || (ic->version != lenv_root->version) || local) {
+					for (int i = 0; (i < n) && valid; i++) {
+						lval* f = lenv_get(e, c->consts[pc[4 + 2*i]]);
+						valid = (ltype(f) == LVAL_FUN) && (f->builtin == c->consts[pc[5 + 2*i]]->builtin);
+						lval_del(f);
+					}
+					if (valid && lenv_root && !local) {
+						ic->version = lenv_root->version;
+						ic->value   = c->consts[pc[0]];
+					}
+				}
+
+				if (valid) {
+					stack[sp++] = lval_ref(c->consts[pc[0]]);
+					pc = c->ops + pc[3];
+				} else {
+					pc += 4 + 2 * n;
+				}
+				break;
+			}
+
+			case LOP_RETURN:
+				return stack[sp-1];
+		}
+	}
+}
+
+/* Extract a single element from an s-expression */
+
+lval* lval_pop(lval* v, int i) {
+	if (v != NULL) {
+		lval* x = v->cell[i];
+
+		/* Close the gap by moving whichever side of it is shorter */
+
+		if (i < v->count / 2) {
+			memmove(&v->cell[1], &v->cell[0], sizeof(lval*) * i);
+			v->cell++;
+		} else {
+			memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+		}
+		v->count--;
+		v->hash = 0;
+
+		/* Once empty, start filling from the beginning of the vector again */
+
+		if (v->count == 0) {
+			v->cell = v->base;
+		}
+
+		return x;
+	} else {
+		return lval_err("required parameters missing");
+	}
+}
+
+/* Extract and delete a single element from an s-expression */
+
+lval* lval_take(lval* v, int i) {
+	lval* x = lval_pop(v, i);
+	lval_del(v);
+	return x;
+}
+
+/* Operators shared by the arithmetic, order, equality and logic builtins */
+
+enum lopr {
+	LOPR_ADD, LOPR_SUB, LOPR_MUL, LOPR_DIV, LOPR_MOD,
+	LOPR_GT,  LOPR_LT,  LOPR_GE,  LOPR_LE,
+	LOPR_EQ,  LOPR_NE,
+	LOPR_AND, LOPR_OR
+};
+
+static char* lopr_names[] = {
+	"+",  "-",  "*",  "/",  "%",
+	">",  "<",  ">=", "<=",
+	"==", "!=",
+	"and", "or"
+};
+
+/* Check the divisor of an arithmetic operator, returning the error it would raise or NULL
+ *
+ * Besides division by zero, LONG_MIN / -1 overflows and traps just the same.
+ */
+
+static inline char* lopr_fault(int op, long x, long y) {
+	if ((op == LOPR_DIV) || (op == LOPR_MOD)) {
+		if (y == 0) {
+			return (op == LOPR_DIV) ? "Division by zero!" : "Modulo by zero!";
+		}
+		if ((x == LONG_MIN) && (y == -1)) {
+			return "Integer overflow!";
+		}
+	}
+	return NULL;
+}
+
+/* Apply one arithmetic operator, the divisor has already been checked by lopr_fault */
+
+static inline long lopr_arith(int op, long x, long y) {
+	switch (op) {
+		case LOPR_ADD: return x + y;
+		case LOPR_SUB: return x - y;
+		case LOPR_MUL: return x * y;
+		case LOPR_DIV: return x / y;
+		case LOPR_MOD: return x % y;
+	}
+	return 0;
+}
+
+/* Handle built-in operations, each builtin below passes a constant
+   operator so the compiler can specialise the inlined body */
+
+static inline lval* builtin_op(lenv* e, lval* a, int op) {
+
+	/* Make sure we received some arguments */
+
+	if (a->count == 0) {
+		lval_del(a);
+		return lval_err("Math operation called with no arguments");
+	}
+
+	/* Fast path for the common binary case */
+
+	if (a->count == 2 && ltype(a->cell[0]) == LVAL_NUM && ltype(a->cell[1]) == LVAL_NUM) {
+		long x = lnum(a->cell[0]);
+		long y = lnum(a->cell[1]);
+		lval_del(a);
+		char* fault = lopr_fault(op, x, y);
+		if (fault) {
+			return lval_err("%s", fault);
+		}
+		return lval_num(lopr_arith(op, x, y));
+	}
+
+	/* Ensure all arguments are numbers */
+
+	for (int i = 0; i < a->count; i++) {
+		if (ltype(a->cell[i]) != LVAL_NUM) {
+			lval_del(a);
+			return lval_err("Cannot operate on a non-number!");
+		}
+	}
+
+	/* The first element accumulates the result */
+
+	long x = lnum(a->cell[0]);
+
+	/* If no argument and subtraction operation requested, perform unary negation */
+
+	if ((op == LOPR_SUB) && (a->count == 1)) {
+		x = -x;
+	}
+
+	/* Process all remaining elements */
+
+	for (int i = 1; i < a->count; i++) {
+
+		long y = lnum(a->cell[i]);
+
+		char* fault = lopr_fault(op, x, y);
+		if (fault) {
+			lval_del(a);
+			return lval_err("%s", fault);
+		}
+
+		x = lopr_arith(op, x, y);
+
+	}
+
+	/* Delete the input expression and return the result */
+
+	lval_del(a);
+	return lval_num(x);
+
+}
+
+/* Handle built-in 'head' function */
+
+lval* builtin_head(lenv* e, lval* a) {
+
+  	LASSERT_NUM("head", a, 1);
+	LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("head", a, 0)
+
+  	lval* v = lval_take(a, 0);
+  	lval* x = (v->count == 1) ? lval_ref(v) : lval_slice(v, 0, 1);
+  	lval_del(v);
+
+  	return x;
+}
+
+/* Handle built-in 'tail' function */
+
+lval* builtin_tail(lenv* e, lval* a) {
+
+  	LASSERT_NUM("tail", a, 1);
+	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("tail", a, 0)
+
+  	/* Drop the first cell in place from a list of our own, otherwise view the rest */
+
+  	lval* v = lval_take(a, 0);
+  	if ((v->refs == 1) && !v->whole) {
+  		lval_del(lval_pop(v, 0));
+  		return v;
+  	}
+
+  	lval* x = lval_slice(v, 1, v->count - 1);
+  	lval_del(v);
+
+  	return x;
+}
+
+/* Handle built-in 'list' function */
+
+lval* builtin_list(lenv* e, lval* a) {
+	a->type = LVAL_QEXPR;
+	return a;
+}
+
+/* Handle built-in 'eval' function */
+
+lval* builtin_eval(lenv* e, lval* a) {
+
+  	LASSERT_NUM("eval", a, 1);
+	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+  	lval* x = lval_own(lval_take(a, 0));
+  	x->type = LVAL_SEXPR;
+
+  	return lval_eval(e, x);
+}
+
+/* Handle built-in 'join' function */
+
+lval* builtin_join(lenv* e, lval* a) {
+
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+  	}
+
+  	lval* x = lval_own(lval_pop(a, 0));
+
+  	while (a->count) {
+    	x = lval_join(x, lval_own(lval_pop(a, 0)));
+  	}
+
+  	lval_del(a);
+
+  	return x;
+}
+
+lval* lval_join(lval* x, lval* y) {
+
+  	/* Move all the cells of 'y' onto the end of 'x' */
+
+  	if (y->count) {
+  		lval_reserve(x, y->count);
+  		memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+  		x->count += y->count;
+  		x->hash   = 0;
+  		y->count  = 0;
+  	}
+
+  	/* Delete the empty 'y' and return 'x' */
+
+  	lval_del(y);  
+
+  	return x;
+}
+
+/* Handle built-in 'cons' function */
+
+lval* builtin_cons(lenv* e, lval* a) {
+
+  	LASSERT_NUM("cons", a, 2);
+	LASSERT_TYPE("cons", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+
+  	lval* x = lval_qexpr();
+  	lval_add(x, lval_pop(a, 0));
+  	a->cell[0] = lval_own(a->cell[0]);
+  	while (a->cell[0]->count) {
+  		lval_add(x, lval_pop(a->cell[0],0));
+  	}
+  	lval_del(a);
+
+  	return x;
+}
+
+/* Handle built-in 'len' function */
+
+lval* builtin_len(lenv* e, lval* a) {
+
+  	LASSERT_NUM("len", a, 1);
+	LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+  	lval* x = lval_num(a->cell[0]->count);
+  	lval_del(a);
+
+  	return x;
+}
+
+/* Packed numeric vectors
+ *
+ * A vector stores its numbers contiguously rather than as a list of lvals, so
+ * the kernels below run straight over a long array. With GCC or Clang they work
+ * on blocks of LVEC_LANES elements using vector extensions, which compile to
+ * SIMD instructions where the target has them, and finish any remainder one
+ * element at a time. Other compilers, or LISPY_NO_SIMD, get the scalar loops.
+ * Arithmetic wraps on overflow as the vector instructions do.
+ */
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LISPY_NO_SIMD)
+	#define LVEC_SIMD
+	#define LVEC_LANES 4
+	typedef long lvec_block __attribute__((vector_size(LVEC_LANES * sizeof(long))));
+#endif
+
+static inline long lvec_wrap_add(long x, long y) {
+	return (long) ((unsigned long) x + (unsigned long) y);
+}
+
+static inline long lvec_wrap_mul(long x, long y) {
+	return (long) ((unsigned long) x * (unsigned long) y);
+}
+
+long lvec_sum(long* d, int n) {
+	long r = 0;
+	int  i = 0;
+#ifdef LVEC_SIMD
+	lvec_block acc = { 0 };
+	for (; i + LVEC_LANES <= n; i += LVEC_LANES) {
+		lvec_block b;
+		memcpy(&b, &d[i], sizeof(b));
+		acc += b;
+	}
+	for (int j = 0; j < LVEC_LANES; j++) {
+		r = lvec_wrap_add(r, acc[j]);
+	}
+#endif
+	for (; i < n; i++) {
+		r = lvec_wrap_add(r, d[i]);
+	}
+	return r;
+}
+
+long lvec_dot(long* x, long* y, int n) {
+	long r = 0;
+	int  i = 0;
+#ifdef LVEC_SIMD
+	lvec_block acc = { 0 };
+	for (; i + LVEC_LANES <= n; i += LVEC_LANES) {
+		lvec_block a, b;
+		memcpy(&a, &x[i], sizeof(a));
+		memcpy(&b, &y[i], sizeof(b));
+		acc += a * b;
+	}
+	for (int j = 0; j < LVEC_LANES; j++) {
+		r = lvec_wrap_add(r, acc[j]);
+	}
+#endif
+	for (; i < n; i++) {
+		r = lvec_wrap_add(r, lvec_wrap_mul(x[i], y[i]));
+	}
+	return r;
+}
+
+/* Find the smallest (or largest) element of a non-empty vector */
+
+long lvec_extreme(long* d, int n, bool max) {
+	long r = d[0];
+	int  i = 0;
+#ifdef LVEC_SIMD
+	if (n >= LVEC_LANES) {
+		lvec_block acc;
+		memcpy(&acc, d, sizeof(acc));
+		for (i = LVEC_LANES; i + LVEC_LANES <= n; i += LVEC_LANES) {
+			lvec_block b;
+			memcpy(&b, &d[i], sizeof(b));
+			lvec_block take = (max) ? (b > acc) : (b < acc);
+			acc = (b & take) | (acc & ~take);
+		}
+		for (int j = 0; j < LVEC_LANES; j++) {
+			r = ((max) ? (acc[j] > r) : (acc[j] < r)) ? acc[j] : r;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		r = ((max) ? (d[i] > r) : (d[i] < r)) ? d[i] : r;
+	}
+	return r;
+}
+
+/* Add y (or the scalar k when y is NULL) to each element of x */
+
+void lvec_add(long* out, long* x, long* y, long k, int n) {
+	int i = 0;
+#ifdef LVEC_SIMD
+	lvec_block kb;
+	for (int j = 0; j < LVEC_LANES; j++) {
+		kb[j] = k;
+	}
+	for (; i + LVEC_LANES <= n; i += LVEC_LANES) {
+		lvec_block a, b;
+		memcpy(&a, &x[i], sizeof(a));
+		if (y) {
+			memcpy(&b, &y[i], sizeof(b));
+		} else {
+			b = kb;
+		}
+		a += b;
+		memcpy(&out[i], &a, sizeof(a));
+	}
+#endif
+	for (; i < n; i++) {
+		out[i] = lvec_wrap_add(x[i], (y) ? y[i] : k);
+	}
+}
+
+/* Handle built-in 'vec' function converting a Q-expression of numbers */
+
+lval* builtin_vec(lenv* e, lval* a) {
+
+	LASSERT_NUM("vec", a, 1);
+	LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+	lval* q = a->cell[0];
+	for (int i = 0; i < q->count; i++) {
+		LASSERT(a, (ltype(q->cell[i]) == LVAL_NUM),
+			"Function 'vec' passed a non-number at element %i. Got %s.",
+			i, ltype_name(ltype(q->cell[i])));
+	}
+
+	lval* v = lval_vec(q->count);
+	for (int i = 0; i < q->count; i++) {
+		v->vdata[i] = lnum(q->cell[i]);
+	}
+	lval_del(a);
+
+	return v;
+}
+
+/* Handle built-in 'vlist' function converting a vector back to a Q-expression */
+
+lval* builtin_vlist(lenv* e, lval* a) {
+
+	LASSERT_NUM("vlist", a, 1);
+	LASSERT_TYPE("vlist", a, 0, LVAL_VEC);
+
+	lval* v = a->cell[0];
+	lval* q = lval_qexpr();
+	lval_reserve(q, v->vcount);
+	for (int i = 0; i < v->vcount; i++) {
+		lval_add(q, lval_num(v->vdata[i]));
+	}
+	lval_del(a);
+
+	return q;
+}
+
+lval* builtin_vsum(lenv* e, lval* a) {
+
+	LASSERT_NUM("vsum", a, 1);
+	LASSERT_TYPE("vsum", a, 0, LVAL_VEC);
+
+	lval* x = lval_num(lvec_sum(a->cell[0]->vdata, a->cell[0]->vcount));
+	lval_del(a);
+
+	return x;
+}
+
+lval* builtin_vdot(lenv* e, lval* a) {
+
+	LASSERT_NUM("vdot", a, 2);
+	LASSERT_TYPE("vdot", a, 0, LVAL_VEC);
+	LASSERT_TYPE("vdot", a, 1, LVAL_VEC);
+	LASSERT(a, (a->cell[0]->vcount == a->cell[1]->vcount),
+		"Function 'vdot' passed vectors of different lengths. Got %i and %i.",
+		a->cell[0]->vcount, a->cell[1]->vcount);
+
+	lval* x = lval_num(lvec_dot(a->cell[0]->vdata, a->cell[1]->vdata, a->cell[0]->vcount));
+	lval_del(a);
+
+	return x;
+}
+
+/* Handle 'vmin' and 'vmax' */
+
+lval* builtin_vextreme(lenv* e, lval* a, char* func, bool max) {
+
+	LASSERT_NUM(func, a, 1);
+	LASSERT_TYPE(func, a, 0, LVAL_VEC);
+	LASSERT(a, (a->cell[0]->vcount != 0),
+		"Function '%s' passed an empty vector.", func);
+
+	lval* x = lval_num(lvec_extreme(a->cell[0]->vdata, a->cell[0]->vcount, max));
+	lval_del(a);
+
+	return x;
+}
+
+lval* builtin_vmin(lenv* e, lval* a) { return builtin_vextreme(e, a, "vmin", false); }
+lval* builtin_vmax(lenv* e, lval* a) { return builtin_vextreme(e, a, "vmax", true);  }
+
+/* Handle 'vmap+' adding a number, or another vector element-wise, to a vector */
+
+lval* builtin_vmap_add(lenv* e, lval* a) {
+
+	LASSERT_NUM("vmap+", a, 2);
+	LASSERT_TYPE("vmap+", a, 0, LVAL_VEC);
+	LASSERT(a, (ltype(a->cell[1]) == LVAL_NUM) || (ltype(a->cell[1]) == LVAL_VEC),
+		"Function 'vmap+' passed incorrect type for argument 1. Got %s, Expected Number or Vector.",
+		ltype_name(ltype(a->cell[1])));
+
+	lval* x = a->cell[0];
+	lval* y = a->cell[1];
+
+	if (ltype(y) == LVAL_VEC) {
+		LASSERT(a, (x->vcount == y->vcount),
+			"Function 'vmap+' passed vectors of different lengths. Got %i and %i.",
+			x->vcount, y->vcount);
+	}
+
+	lval* v = lval_vec(x->vcount);
+	if (ltype(y) == LVAL_VEC) {
+		lvec_add(v->vdata, x->vdata, y->vdata, 0, x->vcount);
+	} else {
+		lvec_add(v->vdata, x->vdata, NULL, lnum(y), x->vcount);
+	}
+	lval_del(a);
+
+	return v;
+}
+
+/* Handle built-in 'init' function */
+
+lval* builtin_init(lenv* e, lval* a) {
+
+  	LASSERT_NUM("init", a, 1);
+	LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("init", a, 0)
+
+  	/* Drop the last cell in place from a list of our own, otherwise view the rest */
+
+  	lval* v = lval_take(a, 0);
+  	if ((v->refs == 1) && !v->whole) {
+  		lval_del(lval_pop(v, v->count - 1));
+  		return v;
+  	}
+
+  	lval* x = lval_slice(v, 0, v->count - 1);
+  	lval_del(v);
+
+  	return x;
+}
+
+/* Provide a built-in function for defining variables */
+
+lval* builtin_var(lenv* e, lval* a, char* func) {
+
+	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+	/* First argument is symbol list */
+
+	lval* syms = a->cell[0];
+
+	/* Ensure all elements of first list are symbols */
+
+	for (int i = 0; i < syms->count; i++) {
+		LASSERT(a, (ltype(syms->cell[i]) == LVAL_SYM),
+			"Function 'def' cannot define non-symbol");
+	}
+
+	/* Check correct number of symbols and values */
+
+	LASSERT(a, (syms->count == a->count-1),
+		"Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
+		func, syms->count, a->count-1);
+ 
+	/* Assign copies of values to symbols, naming lambdas that have no name yet */
+
+	for (int i = 0; i < syms->count; i++) {
+		lval* v = a->cell[i+1];
+		if ((ltype(v) == LVAL_FUN) && v->code && !v->code->name) {
+			v->code->name = syms->cell[i]->sym;
+		}
+		if (strcmp(func, "def") == 0) {
+			lenv_def(e, syms->cell[i], a->cell[i+1]);
+		}
+		if (strcmp(func, "=") == 0) {
+			lenv_put(e, syms->cell[i], a->cell[i+1]);
+		}
+	}
+
+	lval_del(a);
+
+	return lval_sexpr();
+}
+
+/* Create global variables */
+
+lval* builtin_def(lenv* e, lval* a) {
+	return builtin_var(e, a, "def");
+}
+
+/* Create local variables */
+
+lval* builtin_put(lenv* e, lval* a) {
+	return builtin_var(e, a, "=");
+}
+
+/* Create a q-expression that contains a list of all defined functions and variables */
+
+lval* builtin_vars(lenv* e, lval* a) {
+
+  	lval* v = lval_qexpr();
+
+	/* Bound formals come first, listing a repeated formal only once */
+
+	for (int i = 0; i < e->nargs; i++) {
+		if (e->args[i] && (lenv_find_arg(e, e->arg_syms[i]) == i)) {
+			lval_add(v, lval_sym(e->arg_syms[i]));
+		}
+	}
+	for (int i = 0; i < e->count; i++) {
+		lval_add(v, lval_sym(e->syms[i]));
+	}
+	lval_del(a);
+
+	return v;
+}
+
+/* Create a q-expression of allocator statistics:
+ *
+ * {lvals-in-use lvals-allocated lenvs-in-use lenvs-allocated bytes-pooled}
+ */
+
+lval* builtin_mem(lenv* e, lval* a) {
+
+	LASSERT_NUM("mem", a, 0);
+	lval_del(a);
+
+	lval* v = lval_qexpr();
+	lval_add(v, lval_num(lval_pool.allocs - lval_pool.frees));
+	lval_add(v, lval_num(lval_pool.allocs));
+	lval_add(v, lval_num(lenv_pool.allocs - lenv_pool.frees));
+	lval_add(v, lval_num(lenv_pool.allocs));
+	lval_add(v, lval_num(
+		lval_pool.chunk_count * lval_pool.size * (lval_pool.per_chunk + 1) +
+		lenv_pool.chunk_count * lenv_pool.size * (lenv_pool.per_chunk + 1)));
+
+	return v;
+}
+
+/* Report the resources used by the current top level form:
+ *
+ * {steps deepest-nesting bytes}
+ *
+ * The limits on them are set by the host, never by scripts.
+ */
+
+lval* builtin_usage(lenv* e, lval* a) {
+
+	LASSERT_NUM("usage", a, 0);
+	lval_del(a);
+
+	lval* v = lval_qexpr();
+	lval_add(v, lval_num(llim_steps));
+	lval_add(v, lval_num(llim_peak));
+	lval_add(v, lval_num(llim_bytes()));
+
+	return v;
+}
+
+/* Evaluate a q-expression and report what it cost:
+ *
+ * {wall-microseconds cpu-microseconds allocations value}
+ */
+
+lval* builtin_time(lenv* e, lval* a) {
+
+	LASSERT_NUM("time", a, 1);
+	LASSERT_TYPE("time", a, 0, LVAL_QEXPR);
+
+	lval* x = lval_own(lval_take(a, 0));
+	x->type = LVAL_SEXPR;
+
+	long    allocs = lval_pool.allocs + lenv_pool.allocs;
+	clock_t cpu    = clock();
+	long    wall   = ltime_nsec();
+
+	x = lval_eval(e, x);
+
+	wall   = (ltime_nsec() - wall) / 1000;
+	cpu    = clock() - cpu;
+	allocs = lval_pool.allocs + lenv_pool.allocs - allocs;
+
+	lval* v = lval_qexpr();
+	lval_add(v, lval_num(wall));
+	lval_add(v, lval_num((long) ((double) cpu * 1000000.0 / CLOCKS_PER_SEC)));
+	lval_add(v, lval_num(allocs));
+	lval_add(v, x);
+
+	return v;
+}
+
+/* Garbage collector
+ *
+ * Reference counting frees every value as soon as its last reference is
+ * dropped, but cannot free reference cycles, such as a lambda defined in the
+ * environment it captures. This tracing collector reclaims those. It only
+ * runs at the top level between forms, when the eval stack is empty and
+ * everything still in use is reachable from the global environment. Pool nodes that are neither free nor
+ * reachable are swept: references they hold to live values are dropped and
+ * their own storage is released, without following them into lval_del.
+ *
+ * Collections happen once the nodes in use exceed twice those left after the
+ * previous collection, or on request by the 'gc' builtin. Built with
+ * LISPY_NO_POOL there are no pools to sweep and the collector never runs.
+ */
+
+enum { LGC_GARBAGE, LGC_FREE, LGC_LIVE };
+
+typedef struct lgc_heap {
+	lpool*          pool;
+	int             count;    // number of chunks
+	char**          chunks;   // chunks in address order
+	unsigned char*  marks;    // one mark per node slot of each chunk
+} lgc_heap;
+
+static _Thread_local long lgc_threshold   = 65536;
+static _Thread_local bool lgc_requested   = false;
+static _Thread_local long lgc_collections = 0;
+static _Thread_local long lgc_reclaimed   = 0;
+static _Thread_local int  lgc_epoch       = 0;
+
+static int lgc_by_address(const void* x, const void* y) {
+	char* a = *(char**) x;
+	char* b = *(char**) y;
+	return (a > b) - (a < b);
+}
+
+static void lgc_heap_init(lgc_heap* h, lpool* p) {
+
+	h->pool   = p;
+	h->count  = p->chunk_count;
+	h->chunks = malloc(sizeof(char*) * h->count);
+	h->marks  = calloc(h->count * (p->per_chunk + 1), 1);
+
+	int i = 0;
+	for (char* c = p->chunks; c; c = *(char**) c) {
+		h->chunks[i++] = c;
+	}
+	qsort(h->chunks, h->count, sizeof(char*), lgc_by_address);
+}
+
+/* Find the mark for a node by searching for the chunk containing it */
+
+static unsigned char* lgc_mark_of(lgc_heap* h, void* n) {
+
+	size_t span = h->pool->size * (h->pool->per_chunk + 1);
+	int lo = 0;
+	int hi = h->count - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		char* c = h->chunks[mid];
+		if ((char*) n < c) {
+			hi = mid - 1;
+		} else if ((char*) n >= c + span) {
+			lo = mid + 1;
+		} else {
+			return &h->marks[mid * (h->pool->per_chunk + 1) + ((char*) n - c) / h->pool->size];
+		}
+	}
+
+	return NULL;
+}
+
+/* A stack of nodes reached but not yet scanned */
+
+enum { LGC_LVAL, LGC_LENV, LGC_CODE, LGC_MEMO };
+
+typedef struct lgc_item {
+	int   kind;
+	void* p;
+} lgc_item;
+
+typedef struct lgc_state {
+	lgc_heap  vals;
+	lgc_heap  envs;
+	lgc_item* stack;
+	int       depth;
+	int       size;
+	lcode**   codes;          // unreached code found while sweeping
+	int       ncodes;
+	lmemo**   memos;          // unreached memo tables found while sweeping
+	int       nmemos;
+} lgc_state;
+
+static void lgc_push(lgc_state* g, int kind, void* p) {
+	if (g->depth == g->size) {
+		g->size  = (g->size) ? g->size * 2 : 1024;
+		g->stack = realloc(g->stack, sizeof(lgc_item) * g->size);
+	}
+	g->stack[g->depth++] = (lgc_item) { kind, p };
+}
+
+static void lgc_mark_lval(lgc_state* g, lval* v) {
+	if (!v || LVAL_IS_IMM(v)) {
+		return;
+	}
+	unsigned char* m = lgc_mark_of(&g->vals, v);
+	if (m && (*m == LGC_GARBAGE)) {
+		*m = LGC_LIVE;
+		lgc_push(g, LGC_LVAL, v);
+	}
+}
+
+static void lgc_mark_lenv(lgc_state* g, lenv* e) {
+	unsigned char* m = lgc_mark_of(&g->envs, e);
+	if (m && (*m == LGC_GARBAGE)) {
+		*m = LGC_LIVE;
+		lgc_push(g, LGC_LENV, e);
+	}
+}
+
+static void lgc_mark_code(lgc_state* g, lcode* c) {
+	if (c->mark != lgc_epoch) {
+		c->mark = lgc_epoch;
+		lgc_push(g, LGC_CODE, c);
+	}
+}
+
+static void lgc_mark_memo(lgc_state* g, lmemo* m) {
+	if (m->mark != lgc_epoch) {
+		m->mark = lgc_epoch;
+		lgc_push(g, LGC_MEMO, m);
+	}
+}
+
+/* Mark everything reachable from the root environment */
+
+static void lgc_trace(lgc_state* g, lenv* root) {
+
+	lgc_mark_lenv(g, root);
+
+	while (g->depth) {
+
+		lgc_item it = g->stack[--g->depth];
+
+		if (it.kind == LGC_LVAL) {
+			lval* v = it.p;
+			switch (ltype(v)) {
+				case LVAL_FUN:
+					if (v->code) {
+						lgc_mark_lenv(g, v->env);
+						lgc_mark_lval(g, v->formals);
+						lgc_mark_lval(g, v->body);
+						lgc_mark_code(g, v->code);
+					}
+					if (v->memo) {
+						lgc_mark_memo(g, v->memo);
+					}
+					break;
+				case LVAL_SEXPR:
+				case LVAL_QEXPR:
+					if (v->whole) {
+						lgc_mark_lval(g, v->whole);
+						break;
+					}
+					for (int i = 0; i < v->count; i++) {
+						lgc_mark_lval(g, v->cell[i]);
+					}
+					break;
+				case LVAL_PROMISE:
+					lgc_mark_lval(g, (v->delayed) ? v->delayed : v->forced);
+					break;
+				case LVAL_MAP:
+					if (v->mwhole) {
+						lgc_mark_lval(g, v->mwhole);
+						break;
+					}
+					for (int i = 0; i < v->mused; i++) {
+						lgc_mark_lval(g, v->mkeys[i]);
+						lgc_mark_lval(g, v->mvals[i]);
+					}
+					break;
+			}
+		} else if (it.kind == LGC_LENV) {
+			lenv* e = it.p;
+			for (int i = 0; i < e->count; i++) {
+				lgc_mark_lval(g, e->vals[i]);
+			}
+			for (int i = 0; i < e->nargs; i++) {
+				lgc_mark_lval(g, e->args[i]);
+			}
+		} else if (it.kind == LGC_CODE) {
+			lcode* c = it.p;
+			for (int i = 0; i < c->nconsts; i++) {
+				lgc_mark_lval(g, c->consts[i]);
+			}
+		} else {
+			lmemo* m = it.p;
+			lgc_mark_lval(g, m->fn);
+			for (int i = 0; i < m->count; i++) {
+				lgc_mark_lval(g, m->entries[i].args);
+				lgc_mark_lval(g, m->entries[i].value);
+			}
+		}
+	}
+}
+
+/* Drop a reference held by garbage: live values lose a reference, garbage is swept anyway */
+
+static void lgc_drop_lval(lgc_state* g, lval* v) {
+	if (!v || LVAL_IS_IMM(v)) {
+		return;
+	}
+	unsigned char* m = lgc_mark_of(&g->vals, v);
+	if (m && (*m == LGC_LIVE)) {
+		v->refs--;
+	}
+}
+
+static void lgc_drop_code(lgc_state* g, lcode* c) {
+	if (c->mark == lgc_epoch) {
+		c->refs--;
+	} else if (c->mark != -lgc_epoch) {
+		c->mark = -lgc_epoch;
+		g->codes = realloc(g->codes, sizeof(lcode*) * (g->ncodes + 1));
+		g->codes[g->ncodes++] = c;
+	}
+}
+
+static void lgc_drop_memo(lgc_state* g, lmemo* m) {
+	if (m->mark == lgc_epoch) {
+		m->refs--;
+	} else if (m->mark != -lgc_epoch) {
+		m->mark = -lgc_epoch;
+		g->memos = realloc(g->memos, sizeof(lmemo*) * (g->nmemos + 1));
+		g->memos[g->nmemos++] = m;
+	}
+}
+
+/* Visit every garbage node of a heap, first dropping its references then freeing it */
+
+static void lgc_sweep(lgc_state* g, lgc_heap* h, bool release) {
+
+	int per = h->pool->per_chunk;
+
+	for (int c = 0; c < h->count; c++) {
+		for (int i = 1; i <= per; i++) {
+
+			if (h->marks[c * (per + 1) + i] != LGC_GARBAGE) {
+				continue;
+			}
+
+			void* n = h->chunks[c] + h->pool->size * i;
+
+			if (h == &g->vals) {
+				lval* v = n;
+				if (release) {
+					llim_charge(-lval_bytes(v));
+				}
+				switch (ltype(v)) {
+					case LVAL_FUN:
+						if (v->code && !release) {
+							lgc_drop_lval(g, v->formals);
+							lgc_drop_lval(g, v->body);
+							lgc_drop_code(g, v->code);
+						}
+						if (v->memo && !release) {
+							lgc_drop_memo(g, v->memo);
+						}
+						break;
+					case LVAL_ERR:
+						if (release) {
+							free(v->err);
+						}
+						break;
+					case LVAL_VEC:
+						if (release) {
+							free(v->vdata);
+						}
+						break;
+					case LVAL_PROMISE:
+						if (!release) {
+							lgc_drop_lval(g, (v->delayed) ? v->delayed : v->forced);
+						}
+						break;
+					case LVAL_SEXPR:
+					case LVAL_QEXPR:
+						if (release) {
+							free(v->base);
+						} else if (v->whole) {
+							lgc_drop_lval(g, v->whole);
+						} else {
+							for (int j = 0; j < v->count; j++) {
+								lgc_drop_lval(g, v->cell[j]);
+							}
+						}
+						break;
+					case LVAL_MAP:
+						if (release) {
+							free(v->mkeys);
+							free(v->mvals);
+							free(v->mhashes);
+							free(v->mindex);
+						} else if (v->mwhole) {
+							lgc_drop_lval(g, v->mwhole);
+						} else {
+							for (int j = 0; j < v->mused; j++) {
+								lgc_drop_lval(g, v->mkeys[j]);
+								lgc_drop_lval(g, v->mvals[j]);
+							}
+						}
+						break;
+				}
+			} else {
+				lenv* e = n;
+				if (release) {
+					llim_charge(-lenv_bytes(e));
+					if (e->args != e->few_args) {
+						free(e->args);
+					}
+					free(e->syms);
+					free(e->vals);
+					free(e->hashes);
+					free(e->index);
+				} else {
+					for (int j = 0; j < e->count; j++) {
+						lgc_drop_lval(g, e->vals[j]);
+					}
+					for (int j = 0; j < e->nargs; j++) {
+						lgc_drop_lval(g, e->args[j]);
+					}
+				}
+			}
+
+			if (release) {
+				lpool_free(h->pool, n);
+				lgc_reclaimed++;
+			}
+		}
+	}
+}
+
+/* Run a full collection with the given environment as the only root */
+
+void lgc_collect(lenv* root) {
+
+	lgc_state g = { 0 };
+	lgc_heap_init(&g.vals, &lval_pool);
+	lgc_heap_init(&g.envs, &lenv_pool);
+	lgc_epoch++;
+
+	/* Free nodes are not garbage */
+
+	for (void* n = lval_pool.free; n; n = *(void**) n) {
+		*lgc_mark_of(&g.vals, n) = LGC_FREE;
+	}
+	for (void* n = lenv_pool.free; n; n = *(void**) n) {
+		*lgc_mark_of(&g.envs, n) = LGC_FREE;
+	}
+
+	lgc_trace(&g, root);
+
+	/* Drop every reference out of the garbage before any of it is freed */
+
+	lgc_sweep(&g, &g.vals, false);
+	lgc_sweep(&g, &g.envs, false);
+
+	for (int i = 0; i < g.ncodes; i++) {
+		lcode* c = g.codes[i];
+		for (int j = 0; j < c->nconsts; j++) {
+			lgc_drop_lval(&g, c->consts[j]);
+		}
+		free(c->consts);
+		free(c->ops);
+		free(c->arg_syms);
+		free(c->caches);
+		free(c);
+	}
+
+	for (int i = 0; i < g.nmemos; i++) {
+		lmemo* m = g.memos[i];
+		lgc_drop_lval(&g, m->fn);
+		for (int j = 0; j < m->count; j++) {
+			lgc_drop_lval(&g, m->entries[j].args);
+			lgc_drop_lval(&g, m->entries[j].value);
+		}
+		llim_charge(-lmemo_bytes(m));
+		free(m->entries);
+		free(m->buckets);
+		free(m);
+	}
+
+	lgc_sweep(&g, &g.vals, true);
+	lgc_sweep(&g, &g.envs, true);
+
+	free(g.codes);
+	free(g.memos);
+	free(g.stack);
+	free(g.vals.chunks);
+	free(g.vals.marks);
+	free(g.envs.chunks);
+	free(g.envs.marks);
+
+	lgc_collections++;
+}
+
+/* Collect if due, called only between top level forms */
+
+void lgc_safepoint(lenv* root) {
+
+#ifndef LISPY_NO_POOL
+	long live = (lval_pool.allocs - lval_pool.frees) + (lenv_pool.allocs - lenv_pool.frees);
+
+	if (lgc_requested || (live > lgc_threshold)) {
+		lgc_collect(root);
+		live = (lval_pool.allocs - lval_pool.frees) + (lenv_pool.allocs - lenv_pool.frees);
+		lgc_threshold = (live * 2 > 65536) ? live * 2 : 65536;
+		lgc_requested = false;
+	}
+#endif
+
+}
+
+/* Ask for a collection at the next safe point and report the collector's totals so far:
+ *
+ * {collections nodes-reclaimed}
+ */
+
+lval* builtin_gc(lenv* e, lval* a) {
+
+	LASSERT_NUM("gc", a, 0);
+	lval_del(a);
+
+	lgc_requested = true;
+
+	lval* v = lval_qexpr();
+	lval_add(v, lval_num(lgc_collections));
+	lval_add(v, lval_num(lgc_reclaimed));
+
+	return v;
+}
+
+/* Images of the global environment
+ *
+ * An image holds the definitions of the root environment, apart from the
+ * built-in functions under their own names, so startup can load a prelude in
+ * one pass over a mapped file instead of evaluating it.
+ *
+ * The format is the magic "LSPYIMG" and a version byte, the number of
+ * definitions and then each one as a symbol followed by its value.  Integers
+ * are unsigned LEB128 varints, and numbers are zigzag encoded first.  A value
+ * is a tag byte and its fields:
+ *
+ *     N num             B flag                 E len bytes
+ *     S sym             ( count value*         { count value*
+ *     F sym (built-in found by name)           X sym (the result of quit)
+ *     M capacity value (memoized, the results are not kept)
+ *     P forced value    V count num*         H count (key value)*
+ *     L formals body bound named [sym] (present [value])*nargs count (sym value)*
+ *
+ * A symbol is its index in the order symbols first appear, where the next
+ * unused index introduces a new one and is followed by its length and text.
+ * Values shared by reference are written once for each reference.
+ */
+
+#define LIMG_MAGIC     "LSPYIMG"
+#define LIMG_VERSION   1
+#define LIMG_MAX_DEPTH 10000
+
+typedef struct limg_writer {
+	FILE*  f;
+	char** keys;       // symbols written so far, an open addressed table
+	int*   index;      // the index of each
+	int    nsyms;
+	int    slots;
+	int    depth;
+	bool   failed;     // a value was too deeply nested, or circular
+} limg_writer;
+
+void limg_put_uint(limg_writer* w, unsigned long x) {
+	while (x >= 0x80) {
+		fputc((int) (x & 0x7f) | 0x80, w->f);
+		x >>= 7;
+	}
+	fputc((int) x, w->f);
+}
+
+void limg_put_num(limg_writer* w, long x) {
+	limg_put_uint(w, ((unsigned long) x << 1) ^ (unsigned long) (x >> (sizeof(long) * 8 - 1)));
+}
+
+void limg_put_sym(limg_writer* w, char* sym) {
+
+	/* Keep the table no more than half full */
+
+	if ((w->nsyms + 1) * 2 > w->slots) {
+		int    slots = (w->slots) ? w->slots * 2 : 256;
+		char** keys  = calloc(slots, sizeof(char*));
+		int*   index = malloc(sizeof(int) * slots);
+		for (int i = 0; i < w->slots; i++) {
+			if (w->keys[i]) {
+				int j = ((uintptr_t) w->keys[i] >> 3) & (slots - 1);
+				while (keys[j]) {
+					j = (j + 1) & (slots - 1);
+				}
+				keys[j]  = w->keys[i];
+				index[j] = w->index[i];
+			}
+		}
+		free(w->keys);
+		free(w->index);
+		w->keys  = keys;
+		w->index = index;
+		w->slots = slots;
+	}
+
+	/* Symbols are interned so are found by address */
+
+	int mask = w->slots - 1;
+	int i = ((uintptr_t) sym >> 3) & mask;
+	while (w->keys[i] && (w->keys[i] != sym)) {
+		i = (i + 1) & mask;
+	}
+
+	if (w->keys[i]) {
+		limg_put_uint(w, w->index[i]);
+		return;
+	}
+
+	w->keys[i]  = sym;
+	w->index[i] = w->nsyms;
+	limg_put_uint(w, w->nsyms++);
+	limg_put_uint(w, strlen(sym));
+	fputs(sym, w->f);
+}
+
+void limg_put_val(limg_writer* w, lval* v) {
+
+	if (++w->depth > LIMG_MAX_DEPTH) {
+		w->failed = true;
+		w->depth--;
+		return;
+	}
+
+	switch (ltype(v)) {
+		case LVAL_NUM:
+			fputc('N', w->f);
+			limg_put_num(w, lnum(v));
+			break;
+		case LVAL_BOOL:
+			fputc('B', w->f);
+			fputc(lnum(v) != 0, w->f);
+			break;
+		case LVAL_ERR:
+			fputc('E', w->f);
+			limg_put_uint(w, strlen(v->err));
+			fputs(v->err, w->f);
+			break;
+		case LVAL_SYM:
+			fputc('S', w->f);
+			limg_put_sym(w, v->sym);
+			break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			fputc((ltype(v) == LVAL_SEXPR) ? '(' : '{', w->f);
+			limg_put_uint(w, v->count);
+			for (int i = 0; i < v->count; i++) {
+				limg_put_val(w, v->cell[i]);
+			}
+			break;
+		case LVAL_PROMISE:
+			fputc('P', w->f);
+			fputc(v->forced != NULL, w->f);
+			limg_put_val(w, (v->forced) ? v->forced : v->delayed);
+			break;
+		case LVAL_VEC:
+			fputc('V', w->f);
+			limg_put_uint(w, v->vcount);
+			for (int i = 0; i < v->vcount; i++) {
+				limg_put_num(w, v->vdata[i]);
+			}
+			break;
+		case LVAL_MAP:
+			fputc('H', w->f);
+			limg_put_uint(w, v->mcount);
+			for (int i = 0; i < v->mlen; i++) {
+				if (lmap_live(v, i)) {
+					limg_put_val(w, lmap_store(v)->mkeys[i]);
+					limg_put_val(w, lmap_store(v)->mvals[i]);
+				}
+			}
+			break;
+		case LVAL_FUN:
+			if (v->memo) {
+				fputc('M', w->f);
+				limg_put_uint(w, v->memo->capacity);
+				limg_put_val(w, v->memo->fn);
+				break;
+			}
+			if (v->builtin) {
+				fputc((lval_is_quit(v)) ? 'X' : 'F', w->f);
+				limg_put_sym(w, v->name);
+				break;
+			}
+			fputc('L', w->f);
+			limg_put_val(w, v->formals);
+			limg_put_val(w, v->body);
+			limg_put_uint(w, v->bound);
+			fputc(v->name != NULL, w->f);
+			if (v->name) {
+				limg_put_sym(w, v->name);
+			}
+			for (int i = 0; i < v->env->nargs; i++) {
+				fputc(v->env->args[i] != NULL, w->f);
+				if (v->env->args[i]) {
+					limg_put_val(w, v->env->args[i]);
+				}
+			}
+			limg_put_uint(w, v->env->count);
+			for (int i = 0; i < v->env->count; i++) {
+				limg_put_sym(w, v->env->syms[i]);
+				limg_put_val(w, v->env->vals[i]);
+			}
+			break;
+	}
+
+	w->depth--;
+}
+
+/* Whether a root definition is a built-in function under its own name */
+
+bool limg_is_builtin(lenv* e, int i) {
+	lval* v = e->vals[i];
+	return (ltype(v) == LVAL_FUN) && v->builtin && (v->name == e->syms[i]);
+}
+
+/* Write an image of the root environment of 'e' to a file */
+
+lval* limg_save(lenv* e, char* path) {
+
+	while (e->par) {
+		e = e->par;
+	}
+
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		return lval_err("Could not open image '%s' for writing", path);
+	}
+
+	limg_writer w = { f };
+
+	fputs(LIMG_MAGIC, f);
+	fputc(LIMG_VERSION, f);
+
+	int count = 0;
+	for (int i = 0; i < e->count; i++) {
+		count += !limg_is_builtin(e, i);
+	}
+	limg_put_uint(&w, count);
+
+	for (int i = 0; i < e->count; i++) {
+		if (!limg_is_builtin(e, i)) {
+			limg_put_sym(&w, e->syms[i]);
+			limg_put_val(&w, e->vals[i]);
+		}
+	}
+
+	bool failed = ferror(f) || w.failed;
+	failed = (fclose(f) != 0) || failed;
+	free(w.keys);
+	free(w.index);
+
+	if (failed) {
+		remove(path);
+		return (w.failed)
+			? lval_err("Could not save image '%s', a value is too deeply nested or circular", path)
+			: lval_err("Could not write image '%s'", path);
+	}
+
+	return lval_sexpr();
+}
+
+typedef struct limg_reader {
+	unsigned char* pos;
+	unsigned char* end;
+	char**         syms;      // symbols read so far, by index
+	int            nsyms;
+	int            cap;
+	int            depth;
+	lenv*          builtins;  // the built-in functions, to find them by name
+} limg_reader;
+
+bool limg_get_uint(limg_reader* r, unsigned long* x) {
+	*x = 0;
+	for (int shift = 0; (r->pos < r->end) && (shift < 64); shift += 7) {
+		unsigned char c = *r->pos++;
+		*x |= (unsigned long) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Read a count, which can be no more than the bytes left as each item takes at least one */
+
+bool limg_get_count(limg_reader* r, int* n) {
+	unsigned long x;
+	if (!limg_get_uint(r, &x) || (x > (unsigned long) (r->end - r->pos))) {
+		return false;
+	}
+	*n = (int) x;
+	return true;
+}
+
+bool limg_get_num(limg_reader* r, long* x) {
+	unsigned long u;
+	if (!limg_get_uint(r, &u)) {
+		return false;
+	}
+	*x = (long) (u >> 1) ^ -(long) (u & 1);
+	return true;
+}
+
+/* Read a length prefixed string into a new buffer */
+
+char* limg_get_text(limg_reader* r) {
+	int n;
+	if (!limg_get_count(r, &n)) {
+		return NULL;
+	}
+	char* s = malloc(n + 1);
+	memcpy(s, r->pos, n);
+	s[n] = '\0';
+	r->pos += n;
+	return s;
+}
+
+char* limg_get_sym(limg_reader* r) {
+
+	unsigned long i;
+	if (!limg_get_uint(r, &i) || (i > (unsigned long) r->nsyms)) {
+		return NULL;
+	}
+	if (i < (unsigned long) r->nsyms) {
+		return r->syms[i];
+	}
+
+	char* s = limg_get_text(r);
+	if (!s) {
+		return NULL;
+	}
+
+	if (r->nsyms == r->cap) {
+		r->cap  = (r->cap) ? r->cap * 2 : 256;
+		r->syms = realloc(r->syms, sizeof(char*) * r->cap);
+	}
+	r->syms[r->nsyms++] = lsym_intern(s);
+	free(s);
+
+	return r->syms[r->nsyms - 1];
+}
+
+bool limg_get_flag(limg_reader* r, bool* b) {
+	if ((r->pos == r->end) || (*r->pos > 1)) {
+		return false;
+	}
+	*b = *r->pos++;
+	return true;
+}
+
+lval* limg_get_val(limg_reader* r);
+
+/* Read the parts of a lambda, rebuilding and so recompiling it */
+
+lval* limg_get_lambda(limg_reader* r) {
+
+	lval* formals = limg_get_val(r);
+	lval* body    = (formals) ? limg_get_val(r) : NULL;
+
+	if (!body || (ltype(formals) != LVAL_QEXPR) || (ltype(body) != LVAL_QEXPR)) {
+		if (formals) { lval_del(formals); }
+		if (body)    { lval_del(body); }
+		return NULL;
+	}
+	for (int i = 0; i < formals->count; i++) {
+		if (ltype(formals->cell[i]) != LVAL_SYM) {
+			lval_del(formals);
+			lval_del(body);
+			return NULL;
+		}
+	}
+
+	lval* v = lval_lambda(formals, body);
+
+	unsigned long bound;
+	bool named;
+	if (!limg_get_uint(r, &bound) || (bound > (unsigned long) formals->count) ||
+		!limg_get_flag(r, &named) || (named && !(v->name = limg_get_sym(r)))) {
+		lval_del(v);
+		return NULL;
+	}
+	v->bound      = (int) bound;
+	v->code->name = v->name;
+
+	/* Exactly the bound arguments are present, as a call reads those and binds the rest */
+
+	for (int i = 0; i < v->env->nargs; i++) {
+		bool present;
+		if (!limg_get_flag(r, &present) || (present != (i < v->bound)) ||
+			(present && !(v->env->args[i] = limg_get_val(r)))) {
+			lval_del(v);
+			return NULL;
+		}
+	}
+
+	int n;
+	if (!limg_get_count(r, &n)) {
+		lval_del(v);
+		return NULL;
+	}
+	for (int i = 0; i < n; i++) {
+		char* sym = limg_get_sym(r);
+		lval* x   = (sym) ? limg_get_val(r) : NULL;
+		if (!x) {
+			lval_del(v);
+			return NULL;
+		}
+		lval* k = lval_sym(sym);
+		lenv_put(v->env, k, x);
+		lval_del(k);
+		lval_del(x);
+	}
+
+	return v;
+}
+
+/* Read a value, or return NULL if the image is malformed */
+
+lval* limg_get_val(limg_reader* r) {
+
+	if ((r->pos == r->end) || (r->depth >= LIMG_MAX_DEPTH)) {
+		return NULL;
+	}
+
+	r->depth++;
+
+	lval* v = NULL;
+	int   tag = *r->pos++;
+
+	switch (tag) {
+		case 'N': {
+			long x;
+			if (limg_get_num(r, &x)) {
+				v = lval_num(x);
+			}
+			break;
+		}
+		case 'B': {
+			bool b;
+			if (limg_get_flag(r, &b)) {
+				v = lval_bool(b);
+			}
+			break;
+		}
+		case 'E': {
+			char* s = limg_get_text(r);
+			if (s) {
+				v = lval_err("%s", s);
+				free(s);
+			}
+			break;
+		}
+		case 'S': {
+			char* sym = limg_get_sym(r);
+			if (sym) {
+				v = lval_sym(sym);
+			}
+			break;
+		}
+		case '(':
+		case '{': {
+			int n;
+			if (!limg_get_count(r, &n)) {
+				break;
+			}
+			v = (tag == '(') ? lval_sexpr() : lval_qexpr();
+			for (int i = 0; (i < n) && v; i++) {
+				lval* x = limg_get_val(r);
+				if (x) {
+					lval_add(v, x);
+				} else {
+					lval_del(v);
+					v = NULL;
+				}
+			}
+			break;
+		}
+		case 'P': {
+			bool forced;
+			lval* x = (limg_get_flag(r, &forced)) ? limg_get_val(r) : NULL;
+			if (x) {
+				v = lval_promise((forced) ? NULL : x);
+				v->forced = (forced) ? x : NULL;
+			}
+			break;
+		}
+		case 'V': {
+			int n;
+			if (!limg_get_count(r, &n)) {
+				break;
+			}
+			v = lval_vec(n);
+			for (int i = 0; (i < n) && v; i++) {
+				if (!limg_get_num(r, &v->vdata[i])) {
+					lval_del(v);
+					v = NULL;
+				}
+			}
+			break;
+		}
+		case 'H': {
+			int n;
+			if (!limg_get_count(r, &n)) {
+				break;
+			}
+			v = lval_map();
+			for (int i = 0; (i < n) && v; i++) {
+				lval* k = limg_get_val(r);
+				lval* x = (k) ? limg_get_val(r) : NULL;
+				if (x) {
+					lmap_put(v, k, x);
+				} else {
+					if (k) { lval_del(k); }
+					lval_del(v);
+					v = NULL;
+				}
+			}
+			break;
+		}
+		case 'F': {
+			char* sym = limg_get_sym(r);
+			int   i   = (sym) ? lenv_find(r->builtins, sym, lenv_hash(sym)) : -1;
+			if (i != -1) {
+				v = lval_copy(r->builtins->vals[i]);
+			}
+			break;
+		}
+		case 'X': {
+			if (limg_get_sym(r) == lsym_quit) {
+				v = builtin_quit(NULL, lval_sexpr());
+			}
+			break;
+		}
+		case 'L':
+			v = limg_get_lambda(r);
+			break;
+		case 'M': {
+			unsigned long capacity;
+			if (!limg_get_uint(r, &capacity) || (capacity == 0) || (capacity > INT32_MAX)) {
+				break;
+			}
+			lval* fn = limg_get_val(r);
+			if (fn && (ltype(fn) == LVAL_FUN)) {
+				v = lval_memo(fn, (int) capacity);
+			} else if (fn) {
+				lval_del(fn);
+			}
+			break;
+		}
+	}
+
+	r->depth--;
+
+	return v;
+}
+
+/* Decode an image, adding its definitions to the root environment only once all are read */
+
+lval* limg_decode(lenv* e, char* path, unsigned char* src, size_t len) {
+
+	size_t magic = strlen(LIMG_MAGIC);
+	if ((len <= magic) || memcmp(src, LIMG_MAGIC, magic) || (src[magic] != LIMG_VERSION)) {
+		return lval_err("'%s' is not a version %i image", path, LIMG_VERSION);
+	}
+
+	limg_reader r = { src + magic + 1, src + len };
+	r.builtins = lenv_global();
+	lenv_add_builtins(r.builtins);
+
+	lval* defs = lval_qexpr();
+	lval* syms = lval_qexpr();
+
+	int n;
+	bool ok = limg_get_count(&r, &n);
+	for (int i = 0; (i < n) && ok; i++) {
+		char* sym = limg_get_sym(&r);
+		lval* x   = (sym) ? limg_get_val(&r) : NULL;
+		if ((ok = (x != NULL))) {
+			lval_add(syms, lval_sym(sym));
+			lval_add(defs, x);
+		}
+	}
+	ok = ok && (r.pos == r.end);
+
+	if (ok) {
+		for (int i = 0; i < defs->count; i++) {
+			lenv_def(e, syms->cell[i], defs->cell[i]);
+		}
+	}
+
+	lval_del(defs);
+	lval_del(syms);
+	lenv_del(r.builtins);
+	free(r.syms);
+
+	return (ok) ? lval_sexpr() : lval_err("Image '%s' is corrupt", path);
+}
+
+/* Load an image into the root environment of 'e', mapping the file into memory where available */
+
+lval* limg_load(lenv* e, char* path) {
+
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		return lval_err("Could not open image '%s'", path);
+	}
+
+	lval* x;
+
+#ifndef _WIN32
+	struct stat st;
+	if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		unsigned char* src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (src != MAP_FAILED) {
+			posix_madvise(src, st.st_size, POSIX_MADV_SEQUENTIAL);
+			x = limg_decode(e, path, src, st.st_size);
+			munmap(src, st.st_size);
+			fclose(f);
+			return x;
+		}
+	}
+#endif
+
+	/* Otherwise read the whole file into a growing buffer */
+
+	size_t cap = 65536;
+	size_t len = 0;
+	unsigned char* src = malloc(cap);
+	size_t n;
+
+	while ((n = fread(src + len, 1, cap - len, f)) > 0) {
+		len += n;
+		if (len == cap) {
+			cap *= 2;
+			src = realloc(src, cap);
+		}
+	}
+
+	x = limg_decode(e, path, src, len);
+	free(src);
+	fclose(f);
+
+	return x;
+}
+
+/* Save or load the image file named by the symbol in a Q-Expression */
+
+lval* builtin_save_image(lenv* e, lval* a) {
+
+	LASSERT_NUM("save-image", a, 1);
+	LASSERT_TYPE("save-image", a, 0, LVAL_QEXPR);
+	LASSERT(a, (a->cell[0]->count == 1) && (ltype(a->cell[0]->cell[0]) == LVAL_SYM),
+		"Function 'save-image' needs a single symbol naming the file");
+
+	lval* x = limg_save(e, a->cell[0]->cell[0]->sym);
+	lval_del(a);
+
+	return x;
+}
+
+lval* builtin_load_image(lenv* e, lval* a) {
+
+	LASSERT_NUM("load-image", a, 1);
+	LASSERT_TYPE("load-image", a, 0, LVAL_QEXPR);
+	LASSERT(a, (a->cell[0]->count == 1) && (ltype(a->cell[0]->cell[0]) == LVAL_SYM),
+		"Function 'load-image' needs a single symbol naming the file");
+
+	lval* x = limg_load(e, a->cell[0]->cell[0]->sym);
+	lval_del(a);
+
+	return x;
+}
+
+/* Handle built-in 'print' function writing its arguments to stdout on one line */
+
+lval* builtin_print(lenv* e, lval* a) {
+
+	lbuf* out = lval_stream();
+	for (int i = 0; i < a->count; i++) {
+		if (i) {
+			lbuf_putc(out, ' ');
+		}
+		lval_print(a->cell[i]);
+	}
+	lbuf_newline(out);
+	lval_del(a);
+
+	return lval_sexpr();
+}
+
+/* Handle built-in 'write-file' function replacing a file with a printed value */
+
+lval* builtin_write_file(lenv* e, lval* a) {
+
+	LASSERT_NUM("write-file", a, 2);
+	LASSERT_TYPE("write-file", a, 0, LVAL_QEXPR);
+	LASSERT(a, (a->cell[0]->count == 1) && (ltype(a->cell[0]->cell[0]) == LVAL_SYM),
+		"Function 'write-file' needs a single symbol naming the file");
+
+	char* path = a->cell[0]->cell[0]->sym;
+	FILE* f    = fopen(path, "wb");
+	if (!f) {
+		lval* err = lval_err("Could not open '%s' for writing", path);
+		lval_del(a);
+		return err;
+	}
+
+	/* Stream the value through a buffer of its own straight to the file */
+
+	lbuf  b    = { NULL, 0, 0, fileno(f), false, false };
+	lbuf* prev = lval_out;
+
+	lval_out = &b;
+	lval_println(a->cell[1]);
+	lval_out = prev;
+	lbuf_free(&b);
+
+	bool failed = b.failed;
+	if (fclose(f) != 0) {
+		failed = true;
+	}
+
+	lval* x = (failed) ? lval_err("Could not write '%s'", path) : lval_sexpr();
+	lval_del(a);
+
+	return x;
+}
+
+/* Parallel map, filter and reduce
+ *
+ * The elements of a Q-expression are split into blocks, the tasks, which are
+ * dealt out to a pool of worker threads.  Each worker runs its own tasks from
+ * the front and, once out of work, steals the back half of another's.
+ *
+ * Reference counts are not atomic so a worker never touches a value owned by
+ * another thread.  It calls a private clone of the function on clones of the
+ * elements, and a symbol it cannot find in its own frames is looked up in the
+ * caller's environment without taking a reference and cloned on first use.
+ * Definitions made by a task, and the forcing of promises, are therefore local
+ * to the worker and last only as long as the call.  The caller waits while the
+ * tasks run, clones the results into its own pools and then lets each worker
+ * free what it made.
+ */
+
+enum { LPAR_MAP, LPAR_FILTER, LPAR_REDUCE };
+
+/* Make a deep copy of a value which shares nothing with the original */
+
+lval* lval_clone(lval* v) {
+
+	if (LVAL_IS_IMM(v)) {
+		return v;
+	}
+
+	switch (ltype(v)) {
+
+		case LVAL_SEXPR:
+		case LVAL_QEXPR: {
+			lval* x = (ltype(v) == LVAL_SEXPR) ? lval_sexpr() : lval_qexpr();
+			for (int i = 0; i < v->count; i++) {
+				lval_add(x, lval_clone(v->cell[i]));
+			}
+			return x;
+		}
+
+		/* Keys are put again as a clone of a promise hashes differently */
+
+		case LVAL_MAP: {
+			lval* s = lmap_store(v);
+			lval* x = lval_map();
+			for (int i = 0; i < v->mlen; i++) {
+				if (lmap_live(v, i)) {
+					lmap_put(x, lval_clone(s->mkeys[i]), lval_clone(s->mvals[i]));
+				}
+			}
+			return x;
+		}
+
+		case LVAL_PROMISE: {
+			lval* x = lval_promise((v->delayed) ? lval_clone(v->delayed) : NULL);
+			x->forced = (v->forced) ? lval_clone(v->forced) : NULL;
+			return x;
+		}
+
+		/* Lambdas are rebuilt, and so recompiled, from clones of their parts */
+
+		case LVAL_FUN: {
+			if (v->memo) {
+				return lval_memo(lval_clone(v->memo->fn), v->memo->capacity);
+			}
+			if (v->builtin) {
+				return lval_copy(v);
+			}
+			if (!v->code) {
+				lval* x = lval_fun(NULL);
+				x->name = v->name;
+				return x;
+			}
+
+			lval* x = lval_lambda(lval_clone(v->formals), lval_clone(v->body));
+			x->name       = v->name;
+			x->bound      = v->bound;
+			x->code->name = v->code->name;
+
+			for (int i = 0; i < v->env->nargs; i++) {
+				if (v->env->args[i]) {
+					x->env->args[i] = lval_clone(v->env->args[i]);
+				}
+			}
+			for (int i = 0; i < v->env->count; i++) {
+				lval* k = lval_sym(v->env->syms[i]);
+				lval* y = lval_clone(v->env->vals[i]);
+				lenv_put(x->env, k, y);
+				lval_del(k);
+				lval_del(y);
+			}
+			return x;
+		}
+
+		/* Everything else holds no references so a copy is already a clone */
+
+		default:
+			return lval_copy(v);
+	}
+}
+
+/* Build the arguments of a call of one or two values */
+
+lval* lpar_args(lval* x, lval* y) {
+	lval* a = lval_sexpr();
+	lval_add(a, x);
+	if (y) {
+		lval_add(a, y);
+	}
+	return a;
+}
+
+/* A call of pmap, pfilter or preduce
+ *
+ * Map and filter have a result for each element, reduce one for each task.
+ */
+
+typedef struct lpar_job {
+	int    kind;
+	lval*  f;                  // function called, owned by the caller
+	lval*  xs;                 // elements, owned by the caller
+	lenv*  env;                // environment of the caller
+	int    block;              // elements in each task
+	int    ntasks;
+	lval** results;
+	int*   owners;             // worker which ran each task
+	lval* (*share)(lval* v);   // takes an element for the thread running the task
+	llimits limits;            // limits of the caller, applied to each worker in turn
+} lpar_job;
+
+/* Run one task in environment 'e' */
+
+void lpar_task(lpar_job* job, int t, lenv* e, lval* f) {
+
+	int lo = t * job->block;
+	int hi = (lo + job->block < job->xs->count) ? lo + job->block : job->xs->count;
+
+	/* Reduce the task's elements from left to right, stopping at an error */
+
+	if (job->kind == LPAR_REDUCE) {
+		lval* acc = job->share(job->xs->cell[lo]);
+		for (int i = lo + 1; (i < hi) && (ltype(acc) != LVAL_ERR); i++) {
+			acc = lval_call(e, f, lpar_args(acc, job->share(job->xs->cell[i])));
+		}
+		job->results[t] = acc;
+		return;
+	}
+
+	for (int i = lo; i < hi; i++) {
+		job->results[i] = lval_call(e, f, lpar_args(job->share(job->xs->cell[i]), NULL));
+	}
+}
+
+#ifdef LISPY_THREADS
+
+/* Clones of the caller's values made by a worker, an open addressed table keyed by address */
+
+static _Thread_local lval** lpar_from   = NULL;
+static _Thread_local lval** lpar_to     = NULL;
+static _Thread_local int    lpar_cached = 0;
+static _Thread_local int    lpar_slots  = 0;
+
+int lpar_slot(lval** from, int slots, lval* v) {
+	int mask = slots - 1;
+	int i = ((uintptr_t) v >> 4) & mask;
+	while (from[i] && (from[i] != v)) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/* Look up a symbol for a worker in the caller's environment, seen through its clones */
+
+lval* lpar_lookup(lval* k, unsigned long hash) {
+
+	lval* v = NULL;
+
+	for (lenv* e = lpar_shared; e && !v; e = e->par) {
+		int i = lenv_find_arg(e, k->sym);
+		if (i != -1) {
+			v = e->args[i];
+		} else if ((i = lenv_find(e, k->sym, hash)) != -1) {
+			v = e->vals[i];
+		}
+	}
+
+	if (!v) {
+		return lval_err("unbound symbol '%s'!", k->sym);
+	}
+	if (LVAL_IS_IMM(v)) {
+		return v;
+	}
+
+	/* Keep the table no more than half full */
+
+	if ((lpar_cached + 1) * 2 > lpar_slots) {
+		int     slots = (lpar_slots) ? lpar_slots * 2 : 64;
+		lval**  from  = calloc(slots, sizeof(lval*));
+		lval**  to    = calloc(slots, sizeof(lval*));
+		for (int i = 0; i < lpar_slots; i++) {
+			if (lpar_from[i]) {
+				int j = lpar_slot(from, slots, lpar_from[i]);
+				from[j] = lpar_from[i];
+				to[j]   = lpar_to[i];
+			}
+		}
+		free(lpar_from);
+		free(lpar_to);
+		lpar_from  = from;
+		lpar_to    = to;
+		lpar_slots = slots;
+	}
+
+	int i = lpar_slot(lpar_from, lpar_slots, v);
+	if (!lpar_from[i]) {
+		lpar_from[i] = v;
+		lpar_to[i]   = lval_clone(v);
+		lpar_cached++;
+	}
+
+	return lval_ref(lpar_to[i]);
+}
+
+void lpar_forget(void) {
+	for (int i = 0; i < lpar_slots; i++) {
+		if (lpar_from[i]) {
+			lval_del(lpar_to[i]);
+		}
+	}
+	free(lpar_from);
+	free(lpar_to);
+	lpar_from   = NULL;
+	lpar_to     = NULL;
+	lpar_cached = 0;
+	lpar_slots  = 0;
+}
+
+/* The pool of workers, started by the first parallel call
+ *
+ * The caller hands the workers a phase at a time, running the tasks of a job
+ * or releasing its results, and waits until every worker has finished it.
+ */
+
+enum { LPAR_RUN, LPAR_RELEASE, LPAR_EXIT };
+
+typedef struct lpar_worker {
+	pthread_t       thread;
+	pthread_mutex_t lock;      // guards the range of queued tasks
+	int             lo;        // next queued task
+	int             hi;        // end of the queued tasks
+} lpar_worker;
+
+static lpar_worker*    lpar_workers  = NULL;
+static int             lpar_nworkers = 0;    // -1 when calls run in the caller
+static pthread_mutex_t lpar_owner    = PTHREAD_MUTEX_INITIALIZER;  // held by the thread using the pool
+static pthread_mutex_t lpar_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  lpar_start    = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  lpar_done     = PTHREAD_COND_INITIALIZER;
+static lpar_job*       lpar_current  = NULL;
+static int             lpar_phase    = LPAR_RUN;
+static long            lpar_round    = 0;    // counts phases handed out
+static int             lpar_busy     = 0;    // workers yet to finish the phase
+
+/* Take the next task for a worker, stealing when its own are done, or -1 when none are left */
+
+int lpar_next(int self) {
+
+	lpar_worker* w = &lpar_workers[self];
+
+	pthread_mutex_lock(&w->lock);
+	int t = (w->lo < w->hi) ? w->lo++ : -1;
+	pthread_mutex_unlock(&w->lock);
+
+	if (t != -1) {
+		return t;
+	}
+
+	/* Take the back half of the first other worker found with tasks queued */
+
+	for (int i = 1; i < lpar_nworkers; i++) {
+		lpar_worker* v = &lpar_workers[(self + i) % lpar_nworkers];
+
+		pthread_mutex_lock(&v->lock);
+		int n  = (v->hi - v->lo + 1) / 2;
+		int hi = v->hi;
+		v->hi -= n;
+		pthread_mutex_unlock(&v->lock);
+
+		if (n > 0) {
+			pthread_mutex_lock(&w->lock);
+			w->lo = hi - n + 1;
+			w->hi = hi;
+			pthread_mutex_unlock(&w->lock);
+			return hi - n;
+		}
+	}
+
+	return -1;
+}
+
+void* lpar_worker_main(void* arg) {
+
+	int   self  = (int) (intptr_t) arg;
+	long  round = 0;
+	lenv* root  = NULL;
+	lval* f     = NULL;
+
+	pthread_mutex_lock(&lpar_lock);
+
+	for (;;) {
+		while (lpar_round == round) {
+			pthread_cond_wait(&lpar_start, &lpar_lock);
+		}
+		round = lpar_round;
+
+		int       phase = lpar_phase;
+		lpar_job* job   = lpar_current;
+		pthread_mutex_unlock(&lpar_lock);
+
+		if (phase == LPAR_EXIT) {
+			break;
+		}
+
+		/* Definitions made by the tasks go into a root of the worker's own */
+
+		if (phase == LPAR_RUN) {
+			lpar_shared = job->env;
+			llim_set(job->limits);
+			llim_reset();
+			root = lenv_global();
+			f    = lval_clone(job->f);
+			for (int t = lpar_next(self); t != -1; t = lpar_next(self)) {
+				job->owners[t] = self;
+				lpar_task(job, t, root, f);
+			}
+			lbuf_flush(&lval_stdout);
+		} else {
+			for (int t = 0; t < job->ntasks; t++) {
+				if (job->owners[t] != self) {
+					continue;
+				}
+				if (job->kind == LPAR_REDUCE) {
+					lval_del(job->results[t]);
+				} else {
+					int hi = (t + 1) * job->block;
+					for (int i = t * job->block; (i < hi) && (i < job->xs->count); i++) {
+						lval_del(job->results[i]);
+					}
+				}
+			}
+			lval_del(f);
+			lenv_del(root);
+			lpar_forget();
+			lpar_shared = NULL;
+		}
+
+		pthread_mutex_lock(&lpar_lock);
+		if (--lpar_busy == 0) {
+			pthread_cond_signal(&lpar_done);
+		}
+	}
+
+	lpool_cleanup(&lval_pool);
+	lpool_cleanup(&lenv_pool);
+	lbuf_free(&lval_stdout);
+
+	return NULL;
+}
+
+/* Start the pool, one worker per processor unless LISPY_THREADS says otherwise */
+
+int lpar_start_pool(void) {
+
+	if (lpar_nworkers) {
+		return lpar_nworkers;
+	}
+
+	char* s = getenv("LISPY_THREADS");
+	long  n = (s) ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 256) {
+		n = 256;
+	}
+	if (n < 2) {
+		lpar_nworkers = -1;
+		return lpar_nworkers;
+	}
+
+	lpar_workers = calloc(n, sizeof(lpar_worker));
+	for (int i = 0; i < n; i++) {
+		pthread_mutex_init(&lpar_workers[i].lock, NULL);
+		if (pthread_create(&lpar_workers[i].thread, NULL, lpar_worker_main, (void*) (intptr_t) i) != 0) {
+			pthread_mutex_destroy(&lpar_workers[i].lock);
+			break;
+		}
+		lpar_nworkers = i + 1;
+	}
+
+	if (lpar_nworkers < 2) {
+		lpar_nworkers = (lpar_nworkers) ? lpar_nworkers : -1;
+	}
+
+	return lpar_nworkers;
+}
+
+/* Hand the workers a phase and wait for all of them to finish it */
+
+void lpar_run_phase(int phase, lpar_job* job) {
+	pthread_mutex_lock(&lpar_lock);
+	lpar_phase   = phase;
+	lpar_current = job;
+	lpar_busy    = lpar_nworkers;
+	lpar_round++;
+	pthread_cond_broadcast(&lpar_start);
+	while (lpar_busy > 0) {
+		pthread_cond_wait(&lpar_done, &lpar_lock);
+	}
+	lpar_current = NULL;
+	pthread_mutex_unlock(&lpar_lock);
+}
+
+/* Run a job across the pool, dealing each worker an equal share of the tasks to start with */
+
+void lpar_run_job(lpar_job* job, lval** results) {
+
+	for (int i = 0; i < lpar_nworkers; i++) {
+		lpar_workers[i].lo = (int) ((long) job->ntasks * i / lpar_nworkers);
+		lpar_workers[i].hi = (int) ((long) job->ntasks * (i + 1) / lpar_nworkers);
+	}
+
+	lpar_run_phase(LPAR_RUN, job);
+
+	/* The results are cloned into the caller's pools before the workers free theirs */
+
+	int nresults = (job->kind == LPAR_REDUCE) ? job->ntasks : job->xs->count;
+	for (int i = 0; i < nresults; i++) {
+		results[i] = lval_clone(job->results[i]);
+	}
+
+	lpar_run_phase(LPAR_RELEASE, job);
+}
+
+#endif
+
+/* Stop the workers, if they were started, freeing what they hold */
+
+void lpar_shutdown(void) {
+#ifdef LISPY_THREADS
+	if (lpar_nworkers > 0) {
+		pthread_mutex_lock(&lpar_lock);
+		lpar_phase = LPAR_EXIT;
+		lpar_round++;
+		pthread_cond_broadcast(&lpar_start);
+		pthread_mutex_unlock(&lpar_lock);
+		for (int i = 0; i < lpar_nworkers; i++) {
+			pthread_join(lpar_workers[i].thread, NULL);
+			pthread_mutex_destroy(&lpar_workers[i].lock);
+		}
+		free(lpar_workers);
+		lpar_workers  = NULL;
+		lpar_nworkers = 0;
+	}
+#endif
+}
+
+/* Take the caller's own reference to an element when a task runs in the caller */
+
+lval* lpar_share(lval* v) {
+	return lval_ref(v);
+}
+
+/* Apply the function of a call of pmap, pfilter or preduce to the elements
+ *
+ * The tasks run in the calling thread, as with a plain map, when there is only
+ * one processor, when another interpreter instance is using the pool or when
+ * called from a task, which would otherwise wait for its own pool.
+ */
+
+lval* lpar_apply(lenv* e, lval* a, int kind) {
+
+	lval* f  = a->cell[0];
+	lval* xs = a->cell[a->count - 1];
+	int   n  = xs->count;
+
+	lpar_job job = { kind, f, xs, e };
+	job.block  = (n) ? n : 1;
+	job.ntasks = (n) ? 1 : 0;
+	job.share  = lpar_share;
+	job.limits = llim_max;
+
+	int    nresults = 0;
+	lval** results  = NULL;
+
+#ifdef LISPY_THREADS
+	if ((n > 1) && !lpar_shared && (pthread_mutex_trylock(&lpar_owner) == 0)) {
+		if (lpar_start_pool() > 1) {
+			job.block    = (n / (lpar_nworkers * 8) > 1) ? n / (lpar_nworkers * 8) : 1;
+			job.ntasks   = (n + job.block - 1) / job.block;
+			job.share    = lval_clone;
+			nresults     = (kind == LPAR_REDUCE) ? job.ntasks : n;
+			job.results  = malloc(sizeof(lval*) * nresults);
+			job.owners   = malloc(sizeof(int) * job.ntasks);
+			results      = malloc(sizeof(lval*) * nresults);
+			lbuf_flush(&lval_stdout);
+			lpar_run_job(&job, results);
+			free(job.results);
+			free(job.owners);
+		}
+		pthread_mutex_unlock(&lpar_owner);
+	}
+#endif
+
+	if (!results) {
+		nresults    = (kind == LPAR_REDUCE) ? job.ntasks : n;
+		results     = malloc(sizeof(lval*) * (nresults + 1));
+		job.results = results;
+		if (job.ntasks) {
+			lpar_task(&job, 0, e, f);
+		}
+	}
+
+	/* Combine the results in order, keeping the first error */
+
+	lval* x = (kind == LPAR_REDUCE) ? lval_ref(a->cell[1]) : lval_qexpr();
+
+	for (int i = 0; i < nresults; i++) {
+		lval* r = results[i];
+
+		if (ltype(x) == LVAL_ERR) {
+			lval_del(r);
+			continue;
+		}
+		if (ltype(r) == LVAL_ERR) {
+			lval_del(x);
+			x = r;
+			continue;
+		}
+
+		switch (kind) {
+			case LPAR_MAP:
+				lval_add(x, r);
+				break;
+			case LPAR_FILTER:
+				if (ltype(r) != LVAL_NUM) {
+					lval_del(x);
+					x = lval_err("Function 'pfilter' predicate returned %s, Expected %s.",
+						ltype_name(ltype(r)), ltype_name(LVAL_NUM));
+				} else if (lnum(r)) {
+					lval_add(x, lval_ref(xs->cell[i]));
+				}
+				lval_del(r);
+				break;
+			case LPAR_REDUCE:
+				x = lval_call(e, f, lpar_args(x, r));
+				break;
+		}
+	}
+
+	free(results);
+	lval_del(a);
+
+	return x;
+}
+
+/* Apply a function to each element of a Q-Expression in parallel, giving the results in order */
+
+lval* builtin_pmap(lenv* e, lval* a) {
+
+	LASSERT_NUM("pmap", a, 2);
+	LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+	LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+	return lpar_apply(e, a, LPAR_MAP);
+}
+
+/* Keep the elements of a Q-Expression for which a predicate, tested in parallel, is non zero */
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+
+	LASSERT_NUM("pfilter", a, 2);
+	LASSERT_TYPE("pfilter", a, 0, LVAL_FUN);
+	LASSERT_TYPE("pfilter", a, 1, LVAL_QEXPR);
+
+	return lpar_apply(e, a, LPAR_FILTER);
+}
+
+/* Reduce a Q-Expression with a function from an initial value
+ *
+ * The blocks are reduced in parallel and their results then reduced in order
+ * from the initial value, so the function should be associative.
+ */
+
+lval* builtin_preduce(lenv* e, lval* a) {
+
+	LASSERT_NUM("preduce", a, 3);
+	LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+	LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+	return lpar_apply(e, a, LPAR_REDUCE);
+}
+
+/* Handle the quit command
+ *
+ * Its result is a built-in of its own, so it compares, hashes, prints and
+ * copies like any other, which the REPL recognizes by lval_is_quit.  Calling
+ * it quits again.
+ */
+
+lval* builtin_quit(lenv* e, lval* a) {
+	lval_del(a);
+	lval* v = lval_fun(builtin_quit_value);
+	v->name = lsym_quit;
+	return v;
+}
+
+lval* builtin_quit_value(lenv* e, lval* a) {
+	return builtin_quit(e, a);
+}
+
+/* Handle the lamda command */
+
+lval* builtin_lamda(lenv* e, lval* a) {
+
+	/* Validate inputs: two arguments both of which are Q-Expressions */
+
+	LASSERT_NUM("\\", a, 2);
+	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+	/* Check that the first Q-Expression contains only symbols */
+
+	for(int i = 0; i < a->cell[0]->count; i++) {
+		LASSERT(a, (ltype(a->cell[0]->cell[i]) == LVAL_SYM),
+			"Cannot define a non-symbol. Got %s, Expected %s.",
+			ltype_name(ltype(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+	}
+
+	/* Pop first two arguments and pass them to lval_lambda */
+
+	lval* formals = lval_pop(a, 0);
+	lval* body = lval_pop(a, 0);
+	lval_del(a);
+
+	return lval_lambda(formals, body);
+}
+
+/* Handle testing of number order */
+
+static inline lval* builtin_ord(lenv* e, lval* a, int op) {
+
+	/* Validate inputs */
+
+	LASSERT_NUM(lopr_names[op], a, 2);
+	LASSERT_TYPE(lopr_names[op], a, 0, LVAL_NUM);
+	LASSERT_TYPE(lopr_names[op], a, 1, LVAL_NUM);
+
+	long x = lnum(a->cell[0]);
+	long y = lnum(a->cell[1]);
+	int r = 0;
+
+	switch (op) {
+		case LOPR_GT: r = (x >  y); break;
+		case LOPR_LT: r = (x <  y); break;
+		case LOPR_GE: r = (x >= y); break;
+		case LOPR_LE: r = (x <= y); break;
+	}
+
+	lval_del(a);
+
+	return lval_num(r);
+
+}
+
+/* Handle equality testing */
+
+int lval_eq(lval* x, lval* y) {
+
+	/* A value is always equal to itself */
+
+	if (x == y) {
+		return 1;
+	}
+
+	/* Different Types are always unequal */
+
+	if (ltype(x) != ltype(y)) {
+		return 0;
+	}
+
+	/* Compare Based upon type */
+
+	switch (ltype(x)) {
+
+		/* Compare Number Value */
+
+		case LVAL_NUM:
+		case LVAL_BOOL:
+			return (lnum(x) == lnum(y));
+
+		/* Compare String Values */
+
+		case LVAL_ERR:
+			return (strcmp(x->err, y->err) == 0);
+		case LVAL_SYM:
+			return (x->sym == y->sym);
+
+		/* If Builtin compare functions, otherwise compare formals and body */
+
+		case LVAL_FUN:
+			if (x->builtin || y->builtin) {
+				return (x->builtin == y->builtin) && (x->memo == y->memo);
+			} else {
+				/* Partial applications are equal only with equal values bound */
+
+				if ((x->formals->count != y->formals->count) || (x->bound != y->bound)) {
+					return 0;
+				}
+				for (int i = 0; i < x->formals->count; i++) {
+					if (!lval_eq(x->formals->cell[i], y->formals->cell[i])) {
+						return 0;
+					}
+				}
+				for (int i = 0; i < x->bound; i++) {
+					if (!lval_eq(x->env->args[i], y->env->args[i])) {
+						return 0;
+					}
+				}
+				return lval_eq(x->body, y->body);
+			}
+
+		/* Promises are only equal to themselves */
+
+		case LVAL_PROMISE:
+			return (x == y);
+
+		/* Vectors are equal when their elements are */
+
+		case LVAL_VEC:
+			return (x->vcount == y->vcount) &&
+				(memcmp(x->vdata, y->vdata, sizeof(long) * x->vcount) == 0);
+
+		/* Maps are equal when they hold equal values under equal keys, in any order */
+
+		case LVAL_MAP:
+			if (x->mcount != y->mcount) {
+				return 0;
+			}
+			for (int i = 0; i < x->mlen; i++) {
+				if (!lmap_live(x, i)) {
+					continue;
+				}
+				lval* k = lmap_store(x)->mkeys[i];
+				int   j = lmap_find(y, k, lmap_store(x)->mhashes[i]);
+				if ((j == -1) || !lval_eq(lmap_store(x)->mvals[i], lmap_store(y)->mvals[j])) {
+					return 0;
+				}
+			}
+			return 1;
+
+		/* If list compare every individual element */
+
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			if (x->count != y->count) {
+				return 0;
+			}
+
+			/* Lists viewing the same cells are equal */
+
+			if (x->cell == y->cell) {
+				return 1;
+			}
+
+			/* Lists whose hashes are both known and differ cannot be equal */
+
+			if (x->hash && y->hash && (x->hash != y->hash)) {
+				return 0;
+			}
+			for (int i = 0; i < x->count; i++) {
+				/* If any element not equal then whole list not equal */
+				if (!lval_eq(x->cell[i], y->cell[i])) {
+					return 0;
+				}
+			}
+
+			/* Otherwise lists must be equal */
+
+			return 1;
+			break;
+	}
+
+	return 0;
+}
+
+/* Implement a built-in "not" operator */
+
+lval* builtin_not(lenv* e, lval* a) {
+
+	LASSERT_NUM("!", a, 1);
+	LASSERT_TYPE("!", a, 0, LVAL_NUM);
+
+	lval* x = lval_num((lnum(a->cell[0])) ? 0 : 1);
+
+	lval_del(a);
+
+	return x;
+
+}
+
+/* Handle testing logic functions */
+
+static inline lval* builtin_logic(lenv* e, lval* a, int op) {
+
+	/* Validate inputs as each is evaluated, stopping once the result is known */
+
+	LASSERT_NUM(lopr_names[op], a, 2);
+
+	for (int i = 0; i < 2; i++) {
+
+		lval* x = lval_eval(e, lval_pop(a, 0));
+		if (ltype(x) == LVAL_ERR) {
+			lval_del(a);
+			return x;
+		}
+		if (ltype(x) != LVAL_NUM) {
+			lval* err = lval_err("Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+				lopr_names[op], i, ltype_name(ltype(x)), ltype_name(LVAL_NUM));
+			lval_del(x);
+			lval_del(a);
+			return err;
+		}
+
+		bool b = lnum(x);
+		lval_del(x);
+
+		if ((op == LOPR_AND) ? !b : b) {
+			lval_del(a);
+			return lval_num(b);
+		}
+	}
+
+	lval_del(a);
+
+	return lval_num(op == LOPR_AND);
+
+}
+
+/* Implement equality comparisions */
+
+static inline lval* builtin_cmp(lenv* e, lval* a, int op) {
 
-/* Extract a single element from an s-expression */
+	LASSERT_NUM(lopr_names[op], a, 2);
 
-lval* lval_pop(lval* v, int i) {
-	if (v != NULL) {
-		lval* x = v->cell[i];
-		memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
-		v->count--;
-		v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-		return x;
-	} else {
-		return lval_err("required parameters missing");
-	}
+	int r = lval_eq(a->cell[0], a->cell[1]);
+	if (op == LOPR_NE) { r = !r; }
+	lval_del(a);
+
+	return lval_num(r);
 }
 
-/* Extract and delete a single element from an s-expression */
+/* Implement the 'delay' special form, promising the value of its unevaluated argument */
 
-lval* lval_take(lval* v, int i) {
-	lval* x = lval_pop(v, i);
-	lval_del(v);
-	return x;
-}
+lval* builtin_delay(lenv* e, lval* a) {
 
-/* Handle built-in operations */
+	LASSERT_NUM("delay", a, 1);
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+	return lval_promise(lval_take(a, 0));
+}
 
-	/* Make sure we received some arguments */
+/* Force a promise, evaluating its expression the first time only
+ *
+ * As with lambda bodies the expression is evaluated in the environment of the
+ * caller, here the one forcing it.  Anything but a promise is its own value.
+ */
 
-	if (a->count == 0) {
-		return lval_err("Math operation called with no arguments");
-	}
+lval* builtin_force(lenv* e, lval* a) {
 
-	/* Ensure all arguments are numbers */
+	LASSERT_NUM("force", a, 1);
 
-	for (int i = 0; i < a->count; i++) {
-		if (a->cell[i]->type != LVAL_NUM) {
-			lval_del(a);
-			return lval_err("Cannot operate on a non-number!");
-		}
+	lval* p = lval_take(a, 0);
+	if (ltype(p) != LVAL_PROMISE) {
+		return p;
 	}
 
-	/* Pop the first element */
+	if (p->delayed) {
+		lval* x = lval_eval(e, lval_ref(p->delayed));
 
-	lval* x = lval_pop(a, 0);
+		/* Errors are not remembered so forcing again retries */
 
-	/* If no argument and subtraction operation requested, perform unary negation */
+		if (ltype(x) == LVAL_ERR) {
+			lval_del(p);
+			return x;
+		}
 
-	if ((strcmp(op, "-") == 0) && (a->count == 0)) {
-		x->num = -x->num;
+		lval_del(p->delayed);
+		p->delayed = NULL;
+		p->forced  = x;
 	}
 
-	/* Process all remaining elements */
-
-	while (a->count > 0) {
+	lval* x = lval_ref(p->forced);
+	lval_del(p);
 
-		/* Pop the next element */
-
-		lval* y = lval_pop(a, 0);
+	return x;
+}
 
-		/* Perform the appropriate operation */
+/* Hash a value structurally, so that values equal under lval_eq hash equally
+ *
+ * The hash of a list's cells is kept in the list, so hashing it again, or
+ * hashing anything containing it, costs nothing until it is modified.  It
+ * leaves out the type, letting 'list' and 'eval' retag a list in place.
+ */
 
-		if (strcmp(op, "+") == 0) {
-			x->num += y->num;
-		}
+static inline unsigned long lval_hash_mix(unsigned long h, unsigned long x) {
+	return (h ^ x) * 16777619UL;
+}
 
-		if (strcmp(op, "-") == 0) {
-			x->num -= y->num;
-		}
+unsigned long lval_hash(lval* v) {
 
-		if (strcmp(op, "*") == 0) {
-			x->num *= y->num;
-		}
+	unsigned long h = lval_hash_mix(2166136261UL, ltype(v));
 
-		if (strcmp(op, "/") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division by zero!");
-				break;
+	switch (ltype(v)) {
+		case LVAL_NUM:
+		case LVAL_BOOL:
+			return lval_hash_mix(h, (unsigned long) lnum(v));
+		case LVAL_ERR:
+			return lval_hash_mix(h, lsym_hash(v->err));
+		case LVAL_SYM:
+			return lval_hash_mix(h, (uintptr_t) v->sym);
+		case LVAL_PROMISE:
+			return lval_hash_mix(h, (uintptr_t) v);
+		case LVAL_VEC:
+			for (int i = 0; i < v->vcount; i++) {
+				h = lval_hash_mix(h, (unsigned long) v->vdata[i]);
+			}
+			return lval_hash_mix(h, v->vcount);
+		case LVAL_FUN:
+			if (v->builtin) {
+				return lval_hash_mix(h, (v->memo) ? (uintptr_t) v->memo : (uintptr_t) v->builtin);
+			}
+			for (int i = 0; i < v->formals->count; i++) {
+				h = lval_hash_mix(h, lval_hash(v->formals->cell[i]));
 			}
-			x->num /= y->num;
+			for (int i = 0; i < v->bound; i++) {
+				h = lval_hash_mix(h, lval_hash(v->env->args[i]));
+			}
+			return lval_hash_mix(h, lval_hash(v->body));
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			if (!v->hash) {
+				unsigned long c = 2166136261UL;
+				for (int i = 0; i < v->count; i++) {
+					c = lval_hash_mix(c, lval_hash(v->cell[i]));
+				}
+				c = lval_hash_mix(c, v->count);
+				v->hash = (c) ? c : 1;
+			}
+			return lval_hash_mix(h, v->hash);
+		case LVAL_MAP: {
+			/* Entries are summed so the order of the keys makes no difference */
+
+			lval* s = lmap_store(v);
+			unsigned long sum = 0;
+			for (int i = 0; i < v->mlen; i++) {
+				if (lmap_live(v, i)) {
+					sum += lval_hash_mix(s->mhashes[i], lval_hash(s->mvals[i]));
+				}
+			}
+			return lval_hash_mix(lval_hash_mix(h, sum), v->mcount);
 		}
+	}
 
-		if (strcmp(op, "%") == 0) {
-			x->num %= y->num;
-		}
+	return h;
+}
+
+/* Maps
+ *
+ * As with environments, keys and values are kept in parallel arrays along with
+ * each key's hash, and 'mindex' is an open-addressing table of positions into
+ * them, so finding a key costs one hash and a short probe.  Keys are compared
+ * with lval_eq, so any value can be a key.
+ *
+ * Maps are shared by reference, and one nothing else refers to is changed in
+ * place.  A change to a shared map instead makes a new version, which views
+ * the arrays of the map through 'mwhole' like a slice views a list.  The
+ * arrays are a log that only grows by appending, and each version sees only
+ * its first 'mlen' entries, so older versions, seeing fewer, never change.  A
+ * key's entry in a version is its last one there, with a NULL value once it
+ * is deleted.  So filling a map through calls which each still hold the
+ * previous version costs amortized O(1) a key, rather than a copy of the map.
+ * A version which is no longer the last of its log, or which most of the
+ * entries it sees no longer belong to, is copied instead.
+ */
 
-		/* Delete the element now that we are done with it */
+/* Find the entry of a key in a version, or -1 when it has none */
 
-		lval_del(y);
+int lmap_find(lval* m, lval* k, unsigned long hash) {
 
+	lval* s = lmap_store(m);
+	if (s->mslots == 0) {
+		return -1;
 	}
 
-	/* Delete the input expression and return the result */
+	/* The last entry of the key counts, and the first is the only one unless entries have been replaced */
 
-	lval_del(a);
-	return x;
+	int found = -1;
+	int mask  = s->mslots - 1;
+	for (int p = hash & mask; s->mindex[p] != -1; p = (p + 1) & mask) {
+		int i = s->mindex[p];
+		if ((i < m->mlen) && (i > found) && (s->mhashes[i] == hash) && lval_eq(s->mkeys[i], k)) {
+			found = i;
+			if (m->mcount == m->mlen) {
+				break;
+			}
+		}
+	}
 
+	return ((found != -1) && s->mvals[found]) ? found : -1;
 }
 
-/* Handle built-in 'head' function */
-
-lval* builtin_head(lenv* e, lval* a) {
+/* Whether entry i is the entry of its key in a version, as all are while none has been replaced */
 
-  	LASSERT_NUM("head", a, 1);
-	LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("head", a, 0)
+bool lmap_live(lval* m, int i) {
+	lval* s = lmap_store(m);
+	return (m->mcount == m->mlen) ||
+		(s->mvals[i] && (lmap_find(m, s->mkeys[i], s->mhashes[i]) == i));
+}
 
-  	lval* v = lval_take(a, 0);  
-  	while (v->count > 1) {
-  		lval_del(lval_pop(v, 1));
-  	}
+/* Enter position i in the first free slot from its key's home slot */
 
-  	return v;
+void lmap_index(lval* m, int i) {
+	int mask = m->mslots - 1;
+	int s = m->mhashes[i] & mask;
+	while (m->mindex[s] != -1) {
+		s = (s + 1) & mask;
+	}
+	m->mindex[s] = i;
 }
 
-/* Handle built-in 'tail' function */
+void lmap_reindex(lval* m, int slots) {
+	llim_charge(sizeof(int) * (slots - m->mslots));
+	m->mslots = slots;
+	m->mindex = realloc(m->mindex, sizeof(int) * slots);
+	for (int s = 0; s < slots; s++) {
+		m->mindex[s] = -1;
+	}
+	for (int i = 0; i < m->mused; i++) {
+		lmap_index(m, i);
+	}
+}
 
-lval* builtin_tail(lenv* e, lval* a) {
+/* Add an entry to the end of the log of map 's', taking the key and value */
 
-  	LASSERT_NUM("tail", a, 1);
-	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("tail", a, 0)
+void lmap_append(lval* s, lval* k, lval* v, unsigned long hash) {
 
-  	lval* v = lval_take(a, 0);  
-  	lval_del(lval_pop(v, 0));
+	if (s->mused == s->msize) {
+		llim_charge(-lval_bytes(s));
+		s->msize   = (s->msize) ? s->msize * 2 : 8;
+		s->mkeys   = realloc(s->mkeys,   sizeof(lval*) * s->msize);
+		s->mvals   = realloc(s->mvals,   sizeof(lval*) * s->msize);
+		s->mhashes = realloc(s->mhashes, sizeof(unsigned long) * s->msize);
+		llim_charge(lval_bytes(s));
+	}
 
-  	return v;
-}
+	int i = s->mused++;
+	s->mkeys[i]   = k;
+	s->mvals[i]   = v;
+	s->mhashes[i] = hash;
 
-/* Handle built-in 'list' function */
+	/* Keep the index no more than half full */
 
-lval* builtin_list(lenv* e, lval* a) {
-	a->type = LVAL_QEXPR;
-	return a;
+	if (s->mused * 2 > s->mslots) {
+		lmap_reindex(s, (s->mslots) ? s->mslots * 2 : 16);
+	} else {
+		lmap_index(s, i);
+	}
 }
 
-/* Handle built-in 'eval' function */
+/* Put a value under a key of a map holding its own log and seeing all of it,
+ * taking both and replacing any value already there.
+ */
 
-lval* builtin_eval(lenv* e, lval* a) {
+void lmap_put(lval* m, lval* k, lval* v) {
 
-  	LASSERT_NUM("eval", a, 1);
-	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+	unsigned long hash = lval_hash(k);
+	int i = lmap_find(m, k, hash);
 
-  	lval* x = lval_take(a, 0);
-  	x->type = LVAL_SEXPR;
+	if (i != -1) {
+		lval_del(k);
+		lval_del(m->mvals[i]);
+		m->mvals[i] = v;
+		return;
+	}
 
-  	return lval_eval(e, x);
+	lmap_append(m, k, v, hash);
+	m->mlen = m->mused;
+	m->mcount++;
 }
 
-/* Handle built-in 'join' function */
-
-lval* builtin_join(lenv* e, lval* a) {
+/* Remove a key and its value, if present, from a map whose entries are all its keys'
+ *
+ * The last entry moves into the gap, so removing is O(1) but changes the
+ * order of the keys.
+ */
 
-	for (int i = 0; i < a->count; i++) {
-		LASSERT_TYPE("join", a, i, LVAL_QEXPR);
-  	}
+void lmap_del(lval* m, lval* k) {
 
-  	lval* x = lval_pop(a, 0);
+	int i = lmap_find(m, k, lval_hash(k));
+	if (i == -1) {
+		return;
+	}
 
-  	while (a->count) {
-    	x = lval_join(x, lval_pop(a, 0));
-  	}
+	/* Empty its slot, then enter again the rest of the run of slots after it
+	 * so every key can still be reached from its home slot.
+	 */
 
-  	lval_del(a);
+	int mask = m->mslots - 1;
+	int s = m->mhashes[i] & mask;
+	while (m->mindex[s] != i) {
+		s = (s + 1) & mask;
+	}
+	m->mindex[s] = -1;
+	for (s = (s + 1) & mask; m->mindex[s] != -1; s = (s + 1) & mask) {
+		int j = m->mindex[s];
+		m->mindex[s] = -1;
+		lmap_index(m, j);
+	}
 
-  	return x;
+	lval_del(m->mkeys[i]);
+	lval_del(m->mvals[i]);
+
+	int last = --m->mcount;
+	m->mlen  = m->mcount;
+	m->mused = m->mcount;
+	if (i != last) {
+		m->mkeys[i]   = m->mkeys[last];
+		m->mvals[i]   = m->mvals[last];
+		m->mhashes[i] = m->mhashes[last];
+		for (s = m->mhashes[i] & mask; m->mindex[s] != last; s = (s + 1) & mask);
+		m->mindex[s] = i;
+	}
 }
 
-lval* lval_join(lval* x, lval* y) {
+/* Drop the entries of a map nothing else refers to that are not those of its keys */
 
-  	/* For each cell in 'y' add it to 'x' */
+void lmap_compact(lval* m) {
 
-  	while (y->count) {
-    	x = lval_add(x, lval_pop(y, 0));
-  	}
+	if ((m->mcount == m->mlen) && (m->mlen == m->mused)) {
+		return;
+	}
 
-  	/* Delete the empty 'y' and return 'x' */
+	/* Find the entries to keep before moving any, as finding them uses the index */
 
-  	lval_del(y);  
+	bool* keep = malloc(m->mused);
+	for (int i = 0; i < m->mused; i++) {
+		keep[i] = (i < m->mlen) && lmap_live(m, i);
+	}
 
-  	return x;
+	int n = 0;
+	for (int i = 0; i < m->mused; i++) {
+		if (keep[i]) {
+			m->mkeys[n]   = m->mkeys[i];
+			m->mvals[n]   = m->mvals[i];
+			m->mhashes[n] = m->mhashes[i];
+			n++;
+		} else {
+			lval_del(m->mkeys[i]);
+			if (m->mvals[i]) {
+				lval_del(m->mvals[i]);
+			}
+		}
+	}
+	free(keep);
+
+	m->mlen  = n;
+	m->mused = n;
+	lmap_reindex(m, m->mslots);
 }
 
-/* Handle built-in 'cons' function */
+/* Make the version of a map a change is made to, taking the map
+ *
+ * That is the map itself when nothing else refers to it, or a copy once its
+ * log is no longer worth adding to, either of which is changed in place.
+ * Otherwise 'append' is set and the change goes on the end of the log, seen by
+ * the map itself when unshared or else by a new version.
+ */
 
-lval* builtin_cons(lenv* e, lval* a) {
+lval* lmap_version(lval* m, bool* append) {
 
-  	LASSERT_NUM("cons", a, 2);
-	LASSERT_TYPE("cons", a, 0, LVAL_QEXPR);
-	LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+	*append = false;
 
-  	lval* x = lval_qexpr();
-  	lval_add(x, lval_pop(a, 0));
-  	while (a->cell[0]->count) {
-  		lval_add(x, lval_pop(a->cell[0],0));
-  	}
-  	lval_del(a);
+	if ((m->refs == 1) && !m->mwhole) {
+		lmap_compact(m);
+		return m;
+	}
 
-  	return x;
+	lval* s = lmap_store(m);
+	if ((m->mlen != s->mused) || (m->mlen - m->mcount > m->mcount + 16)) {
+		lval* x = lval_copy(m);
+		lval_del(m);
+		return x;
+	}
+
+	*append = true;
+	if (m->refs == 1) {
+		return m;
+	}
+
+	lval* x = lval_map();
+	x->mcount = m->mcount;
+	x->mlen   = m->mlen;
+	x->mwhole = lval_ref(s);
+	lval_del(m);
+	return x;
 }
 
-/* Handle built-in 'len' function */
+/* Put a value under a key, taking the map, key and value and returning the map with it */
 
-lval* builtin_len(lenv* e, lval* a) {
+lval* lmap_with(lval* m, lval* k, lval* v) {
 
-  	LASSERT_NUM("len", a, 1);
-	LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+	bool append;
+	m = lmap_version(m, &append);
+	if (!append) {
+		lmap_put(m, k, v);
+		return m;
+	}
 
-  	lval* x = lval_sexpr();
-  	lval_add(x, lval_num(a->cell[0]->count));
-  	lval_del(a);
+	unsigned long hash = lval_hash(k);
+	if (lmap_find(m, k, hash) == -1) {
+		m->mcount++;
+	}
+	lmap_append(lmap_store(m), k, v, hash);
+	m->mlen = lmap_store(m)->mused;
 
-  	return lval_eval(e, x);
+	return m;
 }
 
-/* Handle built-in 'init' function */
+/* Delete a key, taking the map and returning it without the key */
 
-lval* builtin_init(lenv* e, lval* a) {
+lval* lmap_without(lval* m, lval* k) {
 
-  	LASSERT_NUM("init", a, 1);
-	LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("init", a, 0)
+	unsigned long hash = lval_hash(k);
+	if (lmap_find(m, k, hash) == -1) {
+		return m;
+	}
 
-  	lval* v = lval_qexpr();
-	while (a->cell[0]->count > 1) {
-  		lval_add(v, lval_pop(a->cell[0], 0));
-  	}
-  	lval_del(a);
+	bool append;
+	m = lmap_version(m, &append);
+	if (!append) {
+		lmap_del(m, k);
+		return m;
+	}
 
-  	return v;
+	m->mcount--;
+	lmap_append(lmap_store(m), lval_ref(k), NULL, hash);
+	m->mlen = lmap_store(m)->mused;
 
+	return m;
 }
 
-/* Provide a built-in function for defining variables */
+/* Memoization
+ *
+ * (memo f) gives a function returning the result f gave before when called
+ * again with structurally equal arguments.  Only results that are not errors
+ * are remembered.  Free variables are looked up in the caller's environment,
+ * so this is only sound for functions whose result depends on their arguments
+ * alone.  Copies of the function share its table.
+ */
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
+#define LMEMO_CAPACITY 4096
+#define LMEMO_BUCKETS  (1 << 30)
 
-	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+/* Bytes of the storage behind a table, charged while it holds it */
 
-	/* First argument is symbol list */
+long lmemo_bytes(lmemo* m) {
+	return sizeof(lmemo) + sizeof(lmemo_entry) * (long) m->size + sizeof(int) * (long) m->nbuckets;
+}
 
-	lval* syms = a->cell[0];
+/* Grow the table to hold at least one more entry, up to its capacity
+ *
+ * Returns false, leaving the table as it was, when it is at capacity or the
+ * memory cannot be had.  The buckets are kept at least as many as the entries
+ * (up to LMEMO_BUCKETS) and rechained whenever their number changes.
+ */
 
-	/* Ensure all elements of first list are symbols */
+bool lmemo_grow(lmemo* m) {
 
-	for (int i = 0; i < syms->count; i++) {
-		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-			"Function 'def' cannot define non-symbol");
+	if (m->size == m->capacity) {
+		return false;
 	}
 
-	/* Check correct number of symbols and values */
+	size_t size = (m->size) ? (size_t) m->size * 2 : 16;
+	if (size > (size_t) m->capacity) {
+		size = m->capacity;
+	}
 
-	LASSERT(a, (syms->count == a->count-1),
-		"Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
-		func, syms->count, a->count-1);
- 
-	/* Assign copies of values to symbols */
+	lmemo_entry* entries = realloc(m->entries, sizeof(lmemo_entry) * size);
+	if (!entries) {
+		return false;
+	}
+	m->entries = entries;
 
-	for (int i = 0; i < syms->count; i++) {
-		if (strcmp(func, "def") == 0) {
-			lenv_def(e, syms->cell[i], a->cell[i+1]);
+	size_t nbuckets = m->nbuckets;
+	while ((nbuckets < size) && (nbuckets < LMEMO_BUCKETS)) {
+		nbuckets *= 2;
+	}
+
+	if (nbuckets != (size_t) m->nbuckets) {
+		int* buckets = malloc(sizeof(int) * nbuckets);
+		if (!buckets) {
+			return false;
 		}
-		if (strcmp(func, "=") == 0) {
-			lenv_put(e, syms->cell[i], a->cell[i+1]);
+		free(m->buckets);
+		llim_charge(sizeof(int) * (long) (nbuckets - m->nbuckets));
+		m->buckets  = buckets;
+		m->nbuckets = (int) nbuckets;
+
+		for (size_t i = 0; i < nbuckets; i++) {
+			m->buckets[i] = -1;
+		}
+		for (int i = 0; i < m->count; i++) {
+			int* bucket = &m->buckets[m->entries[i].hash & (nbuckets - 1)];
+			m->entries[i].chain = *bucket;
+			*bucket = i;
 		}
 	}
 
-	lval_del(a);
+	llim_charge(sizeof(lmemo_entry) * (long) (size - m->size));
+	m->size = (int) size;
 
-	return lval_sexpr();
+	return true;
 }
 
-/* Create global variables */
-
-lval* builtin_def(lenv* e, lval* a) {
-	return builtin_var(e, a, "def");
+lmemo* lmemo_new(lval* fn, int capacity) {
+
+	lmemo* m = malloc(sizeof(lmemo));
+	m->refs     = 1;
+	m->mark     = 0;
+	m->fn       = fn;
+	m->capacity = capacity;
+	m->count    = 0;
+	m->size     = 0;
+	m->entries  = NULL;
+	m->nbuckets = 1;
+	m->buckets  = malloc(sizeof(int));
+	m->buckets[0] = -1;
+	m->newest = -1;
+	m->oldest = -1;
+	m->hits   = 0;
+	m->misses = 0;
+	llim_charge(lmemo_bytes(m));
+
+	return m;
 }
 
-/* Create local variables */
+/* Construct a memoized function */
 
-lval* builtin_put(lenv* e, lval* a) {
-	return builtin_var(e, a, "=");
+lval* lval_memo(lval* fn, int capacity) {
+	lval* v = lval_fun(builtin_memo_call);
+	v->name = lsym_intern("memo");
+	v->memo = lmemo_new(fn, capacity);
+	return v;
 }
 
-/* Create a q-expression that contains a list of all defined functions and variables */
-
-lval* builtin_vars(lenv* e, lval* a) {
+void lmemo_del(lmemo* m) {
 
-  	lval* v = lval_qexpr();
-	for (int i = 0; i < e->count; i++) {
-		lval_add(v, lval_sym(e->syms[i]));
+	if (--m->refs > 0) {
+		return;
 	}
 
-	return v;
+	for (int i = 0; i < m->count; i++) {
+		lval_del(m->entries[i].args);
+		lval_del(m->entries[i].value);
+	}
+	lval_del(m->fn);
+	llim_charge(-lmemo_bytes(m));
+	free(m->entries);
+	free(m->buckets);
+	free(m);
 }
 
-/* Handle the quit command */
-
-lval* builtin_quit(lenv* e, lval* a) {
-
-	// Do nothing expect pass a null built-in function
+/* Take an entry out of the order of use, or put it back in as the newest */
 
-	lval* v = lval_fun(NULL);
-	v->sym = "quit";
+void lmemo_unlink(lmemo* m, int i) {
+	lmemo_entry* x = &m->entries[i];
+	if (x->newer != -1) { m->entries[x->newer].older = x->older; } else { m->newest = x->older; }
+	if (x->older != -1) { m->entries[x->older].newer = x->newer; } else { m->oldest = x->newer; }
+}
 
-	return v;
+void lmemo_link(lmemo* m, int i) {
+	lmemo_entry* x = &m->entries[i];
+	x->newer = -1;
+	x->older = m->newest;
+	if (m->newest != -1) {
+		m->entries[m->newest].newer = i;
+	} else {
+		m->oldest = i;
+	}
+	m->newest = i;
 }
 
-/* Handle the lamda command */
+/* Remember a result, replacing the least recently used when full
+ *
+ * Should the table hold nothing and be unable to grow, the result is simply
+ * not remembered.
+ */
 
-lval* builtin_lamda(lenv* e, lval* a) {
+void lmemo_put(lmemo* m, unsigned long hash, lval* args, lval* value) {
 
-	/* Validate inputs: two arguments both of which are Q-Expressions */
+	int i;
 
-	LASSERT_NUM("\\", a, 2);
-	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+	if ((m->count < m->size) || lmemo_grow(m)) {
+		i = m->count++;
+	} else if (m->count == 0) {
+		lval_del(args);
+		lval_del(value);
+		return;
+	} else {
+		i = m->oldest;
+		lmemo_unlink(m, i);
 
-	/* Check that the first Q-Expression contains only symbols */
+		int* link = &m->buckets[m->entries[i].hash & (m->nbuckets - 1)];
+		while (*link != i) {
+			link = &m->entries[*link].chain;
+		}
+		*link = m->entries[i].chain;
 
-	for(int i = 0; i < a->cell[0]->count; i++) {
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-			"Cannot define a non-symbol. Got %s, Expected %s.",
-			ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+		lval_del(m->entries[i].args);
+		lval_del(m->entries[i].value);
 	}
 
-	/* Pop first two arguments and pass them to lval_lambda */
+	lmemo_entry* x = &m->entries[i];
+	int* bucket = &m->buckets[hash & (m->nbuckets - 1)];
+	x->hash  = hash;
+	x->args  = args;
+	x->value = value;
+	x->chain = *bucket;
+	*bucket  = i;
+	lmemo_link(m, i);
+}
 
-	lval* formals = lval_pop(a, 0);
-	lval* body = lval_pop(a, 0);
-	lval_del(a);
+lval* lmemo_call(lenv* e, lmemo* m, lval* a) {
 
-	return lval_lambda(formals, body);
-}
+	unsigned long hash = lval_hash(a);
 
-/* Handle testing of number order */
+	for (int i = m->buckets[hash & (m->nbuckets - 1)]; i != -1; i = m->entries[i].chain) {
+		lmemo_entry* x = &m->entries[i];
+		if ((x->hash == hash) && lval_eq(x->args, a)) {
+			m->hits++;
+			lmemo_unlink(m, i);
+			lmemo_link(m, i);
+			lval_del(a);
+			return lval_ref(x->value);
+		}
+	}
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
+	/* Keep a copy of the arguments as the call consumes them, and the table alive across it */
 
-	/* Validate inputs */
+	m->misses++;
+	m->refs++;
 
-	LASSERT_NUM(op, a, 2);
-	LASSERT_TYPE(op, a, 0, LVAL_NUM);
-	LASSERT_TYPE(op, a, 1, LVAL_NUM);
+	lval* args   = lval_copy(a);
+	lval* result = lval_call(e, m->fn, a);
 
-	int r;
+	if (ltype(result) != LVAL_ERR) {
+		lmemo_put(m, hash, args, lval_ref(result));
+	} else {
+		lval_del(args);
+	}
 
-	if (strcmp(op, ">")  == 0) { r = (a->cell[0]->num >  a->cell[1]->num); }
-	if (strcmp(op, "<")  == 0) { r = (a->cell[0]->num <  a->cell[1]->num); }
-	if (strcmp(op, ">=") == 0) { r = (a->cell[0]->num >= a->cell[1]->num); }
-	if (strcmp(op, "<=") == 0) { r = (a->cell[0]->num <= a->cell[1]->num); }
+	lmemo_del(m);
 
-	lval_del(a);
+	return result;
+}
 
-	return lval_num(r);
+/* Never called, lval_call calls a memoized function through its table */
 
+lval* builtin_memo_call(lenv* e, lval* a) {
+	lval_del(a);
+	return lval_err("Memoized function called without its table");
 }
 
-/* Handle equality testing */
+/* Memoize a function, remembering up to the number of results given or the default */
 
-int lval_eq(lval* x, lval* y) {
+lval* builtin_memo(lenv* e, lval* a) {
 
-	/* Different Types are always unequal */
+	LASSERT(a, (a->count == 1) || (a->count == 2),
+		"Function 'memo' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+	LASSERT_TYPE("memo", a, 0, LVAL_FUN);
 
-	if (x->type != y->type) {
-		return 0;
+	int capacity = LMEMO_CAPACITY;
+	if (a->count == 2) {
+		LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+		LASSERT(a, (lnum(a->cell[1]) > 0) && (lnum(a->cell[1]) <= INT32_MAX),
+			"Function 'memo' passed a size of %li, Expected a positive number.", lnum(a->cell[1]));
+		capacity = (int) lnum(a->cell[1]);
 	}
 
-	/* Compare Based upon type */
+	return lval_memo(lval_take(a, 0), capacity);
+}
 
-	switch (x->type) {
+/* Report how a memoized function's table has been used:
+ *
+ * {hits misses entries capacity}
+ */
 
-		/* Compare Number Value */
+lval* builtin_memo_stats(lenv* e, lval* a) {
 
-		case LVAL_NUM:
-		case LVAL_BOOL:
-			return (x->num == y->num);
+	LASSERT_NUM("memo-stats", a, 1);
+	LASSERT(a, (ltype(a->cell[0]) == LVAL_FUN) && a->cell[0]->memo,
+		"Function 'memo-stats' passed %s, Expected a memoized function.", ltype_name(ltype(a->cell[0])));
 
-		/* Compare String Values */
+	lmemo* m = a->cell[0]->memo;
 
-		case LVAL_ERR:
-			return (strcmp(x->err, y->err) == 0);
-		case LVAL_SYM:
-			return (strcmp(x->sym, y->sym) == 0);
+	lval* v = lval_qexpr();
+	lval_add(v, lval_num(m->hits));
+	lval_add(v, lval_num(m->misses));
+	lval_add(v, lval_num(m->count));
+	lval_add(v, lval_num(m->capacity));
 
-		/* If Builtin compare functions, otherwise compare formals and body */
+	lval_del(a);
 
-		case LVAL_FUN:
-			if (x->builtin || y->builtin) {
-				return x->builtin == y->builtin;
-			} else {
-				return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-			}
+	return v;
+}
 
-		/* If list compare every individual element */
+/* Handle built-in 'map' function making a map of its arguments taken as keys and values */
 
-		case LVAL_QEXPR:
-		case LVAL_SEXPR:
-			if (x->count != y->count) {
-				return 0;
-			}
-			for (int i = 0; i < x->count; i++) {
-				/* If any element not equal then whole list not equal */
-				if (!lval_eq(x->cell[i], y->cell[i])) {
-					return 0;
-				}
-			}
+lval* builtin_map(lenv* e, lval* a) {
 
-			/* Otherwise lists must be equal */
+	LASSERT(a, (a->count % 2) == 0,
+		"Function 'map' passed %i arguments, Expected pairs of keys and values.", a->count);
 
-			return 1;
-			break;
+	lval* m = lval_map();
+	while (a->count) {
+		lval* k = lval_pop(a, 0);
+		lmap_put(m, k, lval_pop(a, 0));
 	}
+	lval_del(a);
 
-	return 0;
+	return m;
 }
 
-/* Implement a built-in "not" operator */
+/* Handle built-in 'get' function returning the value under a key, or the default if given */
 
-lval* builtin_not(lenv* e, lval* a) {
+lval* builtin_map_get(lenv* e, lval* a) {
 
-	LASSERT_NUM("!", a, 1);
-	LASSERT_TYPE("!", a, 0, LVAL_NUM);
+	LASSERT(a, (a->count == 2) || (a->count == 3),
+		"Function 'get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+	LASSERT_TYPE("get", a, 0, LVAL_MAP);
 
-	lval* x = lval_pop(a, 0);
+	lval* m = a->cell[0];
+	int   i = lmap_find(m, a->cell[1], lval_hash(a->cell[1]));
 
-	x->num = (x->num) ? 0 : 1;
+	LASSERT(a, (i != -1) || (a->count == 3), "Function 'get' passed a key not in the map.");
 
+	lval* v = (i != -1) ? lval_ref(lmap_store(m)->mvals[i]) : lval_pop(a, 2);
 	lval_del(a);
 
-	return x;
-
+	return v;
 }
 
-/* Handle testing logic functions */
-
-lval* builtin_logic(lenv* e, lval* a, char* op) {
-
-	/* Validate inputs */
+/* Handle built-in 'put' function */
 
-	LASSERT_NUM(op, a, 2);
-	LASSERT_TYPE(op, a, 0, LVAL_NUM);
-	LASSERT_TYPE(op, a, 1, LVAL_NUM);
+lval* builtin_map_put(lenv* e, lval* a) {
 
-	int r;
+	LASSERT_NUM("put", a, 3);
+	LASSERT_TYPE("put", a, 0, LVAL_MAP);
 
-	if (strcmp(op, "and")  == 0) { r = (a->cell[0]->num && a->cell[1]->num); }
-	if (strcmp(op, "or" )  == 0) { r = (a->cell[0]->num || a->cell[1]->num); }
+	lval* m = lval_pop(a, 0);
+	lval* k = lval_pop(a, 0);
 
-	lval_del(a);
+	return lmap_with(m, k, lval_take(a, 0));
+}
 
-	return lval_num(r);
+/* Handle built-in 'del' function */
 
-}
+lval* builtin_map_del(lenv* e, lval* a) {
 
+	LASSERT_NUM("del", a, 2);
+	LASSERT_TYPE("del", a, 0, LVAL_MAP);
 
+	lval* m = lval_pop(a, 0);
+	m = lmap_without(m, a->cell[0]);
+	lval_del(a);
 
-/* Implement equality comparisions */
+	return m;
+}
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
+/* Handle built-in 'keys' function */
 
-	LASSERT_NUM(op, a, 2);
+lval* builtin_map_keys(lenv* e, lval* a) {
 
-	int r;
+	LASSERT_NUM("keys", a, 1);
+	LASSERT_TYPE("keys", a, 0, LVAL_MAP);
 
-	if (strcmp(op, "==") == 0) { r =  lval_eq(a->cell[0], a->cell[1]); }
-	if (strcmp(op, "!=") == 0) { r = !lval_eq(a->cell[0], a->cell[1]); }
+	lval* m = a->cell[0];
+	lval* q = lval_qexpr();
+	lval_reserve(q, m->mcount);
+	for (int i = 0; i < m->mlen; i++) {
+		if (lmap_live(m, i)) {
+			lval_add(q, lval_ref(lmap_store(m)->mkeys[i]));
+		}
+	}
 	lval_del(a);
 
-	return lval_num(r);
+	return q;
 }
 
 /* Implement if-then-else function */
@@ -1261,20 +6620,23 @@ lval* builtin_if(lenv* e, lval* a) {
 	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
 	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-	/* Mark Both Expressions as evaluable */
+	/* Select the branch to take */
 
 	lval* x;
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
 
-	if (a->cell[0]->num) {
-		/* If condition is true evaluate first expression */
-		x = lval_eval(e, lval_pop(a, 1));
+	if (lnum(a->cell[0])) {
+		/* If condition is true the first expression */
+		x = lval_own(lval_pop(a, 1));
 	} else {
-		/* Otherwise evaluate second expression */
-		x = lval_eval(e, lval_pop(a, 2));
+		/* Otherwise the second expression */
+		x = lval_own(lval_pop(a, 2));
 	}
 
+	/* Mark the expression as evaluable and evaluate it */
+
+	x->type = LVAL_SEXPR;
+	x = lval_eval(e, x);
+
 	/* Delete argument list and return */
 
 	lval_del(a);
@@ -1284,31 +6646,72 @@ lval* builtin_if(lenv* e, lval* a) {
 
 /* Create built-in functions for each of the operators */
 
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
-lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, "%"); }
+lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, LOPR_ADD); }
+lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, LOPR_SUB); }
+lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, LOPR_MUL); }
+lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, LOPR_DIV); }
+lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, LOPR_MOD); }
 
 /* Create built-in functions for each of the order tests and equality */
 
-lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">");  }
-lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<");  }
-lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">="); }
-lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<="); }
-lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
-lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
+lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, LOPR_GT); }
+lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, LOPR_LT); }
+lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, LOPR_GE); }
+lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, LOPR_LE); }
+lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, LOPR_EQ); }
+lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, LOPR_NE); }
 
 /* Create built-in boolean logic functions */
 
-lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, "and");  }
-lval* builtin_or(lenv* e, lval* a)  { return builtin_logic(e, a, "or");   }
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, LOPR_AND); }
+lval* builtin_or(lenv* e, lval* a)  { return builtin_logic(e, a, LOPR_OR); }
+
+/* Find the builtin a symbol names by default when that builtin is pure, i.e.
+ * its result depends only on its arguments, so calls on constants can be
+ * folded (see lcode_fold).
+ */
+
+lbuiltin lbuiltin_pure(char* sym) {
+
+	static struct { char* name; lbuiltin func; } pure[] = {
+		{ "+",   builtin_add }, { "-",   builtin_sub }, { "*",   builtin_mul },
+		{ "/",   builtin_div }, { "%",   builtin_mod },
+		{ "add", builtin_add }, { "sub", builtin_sub }, { "mul", builtin_mul },
+		{ "div", builtin_div }, { "mod", builtin_mod },
+		{ ">",   builtin_gt  }, { "<",   builtin_lt  }, { ">=",  builtin_ge  },
+		{ "<=",  builtin_le  }, { "==",  builtin_eq  }, { "!=",  builtin_ne  },
+		{ "!",   builtin_not }, { "not", builtin_not },
+		{ "and", builtin_and }, { "or",  builtin_or  },
+		{ NULL,  NULL }
+	};
+
+	for (int i = 0; pure[i].name; i++) {
+		if (strcmp(pure[i].name, sym) == 0) {
+			return pure[i].func;
+		}
+	}
+
+	return NULL;
+}
 
 /* Register a new built-in function with the environment */
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 	lval* k = lval_sym(name);
 	lval* v = lval_fun(func);
+	v->name = k->sym;
+	lenv_put(e, k, v);
+	lval_del(k);
+	lval_del(v);
+}
+
+/* Register a built-in special form, which is passed its arguments unevaluated */
+
+void lenv_add_special(lenv* e, char* name, lbuiltin func) {
+	lval* k = lval_sym(name);
+	lval* v = lval_fun(func);
+	v->name    = k->sym;
+	v->special = true;
 	lenv_put(e, k, v);
 	lval_del(k);
 	lval_del(v);
@@ -1331,6 +6734,14 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "def",  builtin_def);
 	lenv_add_builtin(e, "=",    builtin_put);
 	lenv_add_builtin(e, "vars", builtin_vars);
+	lenv_add_builtin(e, "mem",  builtin_mem);
+	lenv_add_builtin(e, "usage", builtin_usage);
+	lenv_add_builtin(e, "time", builtin_time);
+	lenv_add_builtin(e, "gc",   builtin_gc);
+	lenv_add_builtin(e, "save-image", builtin_save_image);
+	lenv_add_builtin(e, "load-image", builtin_load_image);
+	lenv_add_builtin(e, "print", builtin_print);
+	lenv_add_builtin(e, "write-file", builtin_write_file);
 	lenv_add_builtin(e, "quit", builtin_quit);
 	lenv_add_builtin(e, "\\",   builtin_lamda);
 
@@ -1347,6 +6758,22 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "div",  builtin_div);
 	lenv_add_builtin(e, "mod",  builtin_mod);
 
+	/* Vector Functions */
+
+	lenv_add_builtin(e, "vec",   builtin_vec);
+	lenv_add_builtin(e, "vlist", builtin_vlist);
+	lenv_add_builtin(e, "vsum",  builtin_vsum);
+	lenv_add_builtin(e, "vdot",  builtin_vdot);
+	lenv_add_builtin(e, "vmin",  builtin_vmin);
+	lenv_add_builtin(e, "vmax",  builtin_vmax);
+	lenv_add_builtin(e, "vmap+", builtin_vmap_add);
+
+	/* Parallel Functions */
+
+	lenv_add_builtin(e, "pmap",    builtin_pmap);
+	lenv_add_builtin(e, "pfilter", builtin_pfilter);
+	lenv_add_builtin(e, "preduce", builtin_preduce);
+
 	/* Comparision Functions */
 
 	lenv_add_builtin(e, "if",   builtin_if);
@@ -1361,78 +6788,514 @@ void lenv_add_builtins(lenv* e) {
 
 	lenv_add_builtin(e, "!",    builtin_not);
 	lenv_add_builtin(e, "not",  builtin_not);
-	lenv_add_builtin(e, "and",  builtin_and);
-	lenv_add_builtin(e, "or",   builtin_or);
+	lenv_add_special(e, "and",  builtin_and);
+	lenv_add_special(e, "or",   builtin_or);
+
+	/* Lazy Evaluation */
+
+	lenv_add_special(e, "delay", builtin_delay);
+	lenv_add_builtin(e, "force", builtin_force);
+
+	/* Memoization */
+
+	lenv_add_builtin(e, "memo",       builtin_memo);
+	lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+	/* Map Functions */
+
+	lenv_add_builtin(e, "map",  builtin_map);
+	lenv_add_builtin(e, "get",  builtin_map_get);
+	lenv_add_builtin(e, "put",  builtin_map_put);
+	lenv_add_builtin(e, "del",  builtin_map_del);
+	lenv_add_builtin(e, "keys", builtin_map_keys);
 
 }
 
 /* Start REPL */
 
+/* Recognize the result of evaluating 'quit' */
+
+bool lval_is_quit(lval* x) {
+	return (ltype(x) == LVAL_FUN) && (x->builtin == builtin_quit_value);
+}
+
+/* Print the result of every top level form of a script, or only errors in batch mode */
+
+static bool lrun_echo = true;
+
+/* Evaluate each top level form of a script in turn, printing its result.
+ *
+ * Returns 0 once the text is exhausted, 1 on a syntax error (which stops the
+ * script, as there is no telling where the next form starts) and -1 when the
+ * script evaluated 'quit'.
+ */
+
+int lrun_source(lenv* e, char* name, char* src, size_t len) {
+
+	lreader r;
+	lreader_init(&r, name, src, len);
+
+	lval* x;
+
+	while ((x = lread_next(&r))) {
+		if (ltype(x) == LVAL_ERR) {
+			lval_println(x);
+			lval_del(x);
+			return 1;
+		}
+
+		llim_reset();
+		x = lval_eval(e, x);
+		if (lval_is_quit(x)) {
+			lval_del(x);
+			return -1;
+		}
+		if (lrun_echo || (ltype(x) == LVAL_ERR)) {
+			lval_println(x);
+		}
+		lval_del(x);
+		lgc_safepoint(e);
+	}
+
+	return 0;
+}
+
+/* Run a script from an open file, mapping it into memory when it is a regular file */
+
+int lrun_stream(lenv* e, char* name, FILE* f) {
+
+	int status;
+
+#ifndef _WIN32
+	struct stat st;
+	if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		char* src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (src != MAP_FAILED) {
+			posix_madvise(src, st.st_size, POSIX_MADV_SEQUENTIAL);
+			status = lrun_source(e, name, src, st.st_size);
+			munmap(src, st.st_size);
+			return status;
+		}
+	}
+#endif
+
+	/* Otherwise read the whole stream into a growing buffer */
+
+	size_t cap = 65536;
+	size_t len = 0;
+	char*  src = malloc(cap);
+	size_t n;
+
+	while ((n = fread(src + len, 1, cap - len, f)) > 0) {
+		len += n;
+		if (len == cap) {
+			cap *= 2;
+			src = realloc(src, cap);
+		}
+	}
+
+	status = lrun_source(e, name, src, len);
+	free(src);
+
+	return status;
+}
+
+/* Run a script file named on the command line, with '-' standing for stdin */
+
+int lrun_file(lenv* e, char* path) {
+
+	if (strcmp(path, "-") == 0) {
+		return lrun_stream(e, "<stdin>", stdin);
+	}
+
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Could not open file '%s'\n", path);
+		return 1;
+	}
+
+	int status = lrun_stream(e, path, f);
+	fclose(f);
+
+	return status;
+}
+
+/* Embedding interface (see lispy.h)
+ *
+ * The allocator pools and collector state are per thread, so an instance
+ * keeps its own and swaps them with the calling thread's while in use.
+ */
+
+struct lispy {
+	lenv*  env;
+	lpool  vals;
+	lpool  envs;
+	long   gc_threshold;
+	bool   gc_requested;
+	long   gc_collections;
+	long   gc_reclaimed;
+	int    gc_epoch;
+	lenv*  root;           // lenv_root of the instance, or of the thread while inside it
+	lbuf   out;            // buffer for stdout of the instance, or of the thread while inside it
+	llimits limits;        // llim_max and the counters, swapped like the pools
+	bool   limited;
+	long   steps;
+	long   depth;
+	long   peak;
+	long   data;
+	bool   quit;
+};
+
+#define LISPY_SWAP(T, x, y) { T t = (x); (x) = (y); (y) = t; }
+
+/* Exchange an instance's state with the calling thread's, entering or leaving it */
+
+void lispy_swap(lispy* l) {
+	LISPY_SWAP(lpool, lval_pool,       l->vals);
+	LISPY_SWAP(lpool, lenv_pool,       l->envs);
+	LISPY_SWAP(long,  lgc_threshold,   l->gc_threshold);
+	LISPY_SWAP(bool,  lgc_requested,   l->gc_requested);
+	LISPY_SWAP(long,  lgc_collections, l->gc_collections);
+	LISPY_SWAP(long,  lgc_reclaimed,   l->gc_reclaimed);
+	LISPY_SWAP(int,   lgc_epoch,       l->gc_epoch);
+	LISPY_SWAP(lenv*, lenv_root,       l->root);
+	LISPY_SWAP(lbuf,  lval_stdout,     l->out);
+	LISPY_SWAP(llimits, llim_max,      l->limits);
+	LISPY_SWAP(bool,    llim_on,       l->limited);
+	LISPY_SWAP(long,    llim_steps,    l->steps);
+	LISPY_SWAP(long,    llim_depth,    l->depth);
+	LISPY_SWAP(long,    llim_peak,     l->peak);
+	LISPY_SWAP(long,    llim_data,     l->data);
+}
+
+#ifdef LISPY_THREADS
+static pthread_once_t lsym_once = PTHREAD_ONCE_INIT;
+#endif
+
+lispy* lispy_new(void) {
+
+#ifdef LISPY_THREADS
+	pthread_once(&lsym_once, lsym_init);
+#else
+	if (!lsym_amp) {
+		lsym_init();
+	}
+#endif
+
+	lispy* l = calloc(1, sizeof(lispy));
+	l->vals.size      = sizeof(lval);
+	l->vals.per_chunk = 1024;
+	l->envs.size      = sizeof(lenv);
+	l->envs.per_chunk = 256;
+	l->gc_threshold   = 65536;
+	l->out.fd         = 1;
+
+	lispy_swap(l);
+	l->env = lenv_global();
+	lenv_add_builtins(l->env);
+	lenv_root = l->env;
+	lispy_swap(l);
+
+	return l;
+}
+
+/* Print a value into a newly allocated string */
+
+char* lval_to_string(lval* v) {
+
+	lbuf  text = { NULL, 0, 0, -1, false, false };
+	lbuf* prev = lval_out;
+
+	lval_out = &text;
+	lval_print(v);
+	lbuf_putc(&text, '\0');
+	lval_out = prev;
+
+	return text.data;
+}
+
+char* lispy_eval_string(lispy* l, const char* src) {
+
+	if (l->quit) {
+		return NULL;
+	}
+
+	lispy_swap(l);
+
+	lreader r;
+	lreader_init(&r, "<string>", (char*) src, strlen(src));
+
+	/* Results are kept until the next is ready, so collect only once the last is printed */
+
+	lval* last = NULL;
+	lval* x;
+
+	while (!l->quit && (x = lread_next(&r))) {
+		bool syntax = (ltype(x) == LVAL_ERR);
+		if (!syntax) {
+			llim_reset();
+			x = lval_eval(l->env, x);
+		}
+
+		if (lval_is_quit(x)) {
+			lval_del(x);
+			l->quit = true;
+			break;
+		}
+		if (last) {
+			lval_del(last);
+		}
+		last = x;
+		if (syntax) {
+			break;
+		}
+	}
+
+	char* text = NULL;
+	if (!l->quit) {
+		text = (last) ? lval_to_string(last) : calloc(1, 1);
+	}
+	if (last) {
+		lval_del(last);
+	}
+	lgc_safepoint(l->env);
+	lbuf_flush(&lval_stdout);
+
+	lispy_swap(l);
+
+	return text;
+}
+
+void lispy_limit(lispy* l, long steps, long depth, long bytes) {
+	lispy_swap(l);
+	llim_set((llimits) { steps, depth, bytes });
+	lispy_swap(l);
+}
+
+void lispy_usage(lispy* l, long* steps, long* depth, long* bytes) {
+	lispy_swap(l);
+	*steps = llim_steps;
+	*depth = llim_peak;
+	*bytes = llim_bytes();
+	lispy_swap(l);
+}
+
+void lispy_free(lispy* l) {
+
+	lispy_swap(l);
+	lenv_del(l->env);
+	lpool_cleanup(&lval_pool);
+	lpool_cleanup(&lenv_pool);
+	lbuf_free(&lval_stdout);
+	lispy_swap(l);
+
+	free(l);
+}
+
+/* The interpreter program, left out when building the library */
+
+#ifndef LISPY_NO_MAIN
+
 int main (int argc, char** argv) {
 
-	/* Initialize the mpc parser for Polish Notation */
-
-	mpc_parser_t* Number = mpc_new("number");
-	mpc_parser_t* Bool   = mpc_new("boolean");
-	mpc_parser_t* Symbol = mpc_new("symbol");
-	mpc_parser_t* Sexpr  = mpc_new("sexpr");
-	mpc_parser_t* Qexpr  = mpc_new("qexpr");
-	mpc_parser_t* Expr   = mpc_new("expr");
-	mpc_parser_t* Lispy  = mpc_new("lispy");
-
-	mpca_lang(MPCA_LANG_DEFAULT,
-  		" \
-    		number : /-?[0-9]+/ ; \
-    		boolean: /^(true|false)$/ ; \
-    		symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ; \
-    		sexpr  : '(' <expr>* ')' ; \
-    		qexpr  : '{' <expr>* '}' ; \
-    		expr   : <number> | <boolean> | <symbol> | <sexpr> | <qexpr> ; \
-    		lispy  : /^/ <expr>* /$/ ; \
-  		",
-  		Number, Bool, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
-	/* Register built-in functions */
+	/* Handle command line options */
 
-	lenv* e = lenv_new();
+	bool  use_mpc  = false;
+	bool  use_repl = false;
+	char* image    = NULL;
+	int   scripts  = 0;
+	llimits limits = { 0, 0, 0 };
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--tree") == 0) {
+			lval_use_vm = false;
+		}
+		if (strcmp(argv[i], "--mpc") == 0) {
+			use_mpc = true;
+		}
+		if (strcmp(argv[i], "--repl") == 0) {
+			use_repl = true;
+		}
+		if (strcmp(argv[i], "--quiet") == 0) {
+			lrun_echo = false;
+		}
+		if (strcmp(argv[i], "--profile") == 0) {
+			lprof_mode = LPROF_FLAT;
+		}
+		if (strcmp(argv[i], "--profile=folded") == 0) {
+			lprof_mode = LPROF_FOLDED;
+		}
+		if (strncmp(argv[i], "--image=", 8) == 0) {
+			image = argv[i] + 8;
+		}
+		if (strncmp(argv[i], "--max-steps=", 12) == 0) {
+			limits.steps = atol(argv[i] + 12);
+		}
+		if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+			limits.depth = atol(argv[i] + 12);
+		}
+		if (strncmp(argv[i], "--max-bytes=", 12) == 0) {
+			limits.bytes = atol(argv[i] + 12);
+		}
+		if ((argv[i][0] != '-') || (strcmp(argv[i], "-") == 0)) {
+			scripts++;
+		}
+	}
+
+	/* Initialize the mpc parser for Polish Notation, only needed when asked for */
+
+	mpc_parser_t* Number = NULL;
+	mpc_parser_t* Bool   = NULL;
+	mpc_parser_t* Symbol = NULL;
+	mpc_parser_t* Sexpr  = NULL;
+	mpc_parser_t* Qexpr  = NULL;
+	mpc_parser_t* Expr   = NULL;
+	mpc_parser_t* Lispy  = NULL;
+
+	if (use_mpc) {
+		Number = mpc_new("number");
+		Bool   = mpc_new("boolean");
+		Symbol = mpc_new("symbol");
+		Sexpr  = mpc_new("sexpr");
+		Qexpr  = mpc_new("qexpr");
+		Expr   = mpc_new("expr");
+		Lispy  = mpc_new("lispy");
+
+		mpca_lang(MPCA_LANG_DEFAULT,
+	  		" \
+	    		number : /-?[0-9]+/ ; \
+	    		boolean: /^(true|false)$/ ; \
+	    		symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ; \
+	    		sexpr  : '(' <expr>* ')' ; \
+	    		qexpr  : '{' <expr>* '}' ; \
+	    		expr   : <number> | <boolean> | <symbol> | <sexpr> | <qexpr> ; \
+	    		lispy  : /^/ <expr>* /$/ ; \
+	  		",
+	  		Number, Bool, Symbol, Sexpr, Qexpr, Expr, Lispy);
+	}
+
+	/* Register built-in functions, then the definitions of an image if given */
+
+	lsym_init();
+
+	lenv* e = lenv_global();
 	lenv_add_builtins(e);
+	lenv_root = e;
+
+	lval_stdout.lines = isatty(fileno(stdout));
+	llim_set(limits);
+
+	bool repeatREPL = true;
+	bool failed     = false;
+
+	if (image) {
+		lval* x = limg_load(e, image);
+		if (ltype(x) == LVAL_ERR) {
+			lval_println(x);
+			repeatREPL = false;
+			failed     = true;
+		}
+		lval_del(x);
+	}
+
+	/* Run the scripts named on the command line, or one piped into stdin,
+	   and skip the REPL unless it was asked for */
+
+	if (repeatREPL && (scripts == 0) && !use_repl && !isatty(fileno(stdin))) {
+		failed     = (lrun_stream(e, "<stdin>", stdin) > 0);
+		repeatREPL = false;
+	}
+
+	for (int i = 1; (i < argc) && repeatREPL; i++) {
+		if ((argv[i][0] != '-') || (strcmp(argv[i], "-") == 0)) {
+			int status = lrun_file(e, argv[i]);
+			failed     = failed || (status > 0);
+			repeatREPL = (status >= 0) && use_repl;
+		}
+	}
 
 	/* Display Initialization Header */
 
-	puts("Lispy Version 0.0.7");
-	puts("Enter 'quit' to exit\n");
+	if (repeatREPL) {
+		lbuf_puts(&lval_stdout, "Lispy Version 0.0.7\n");
+		lbuf_puts(&lval_stdout, "Enter 'quit' to exit\n\n");
+	}
 
 	/* Enter into REPL */
 
-	bool repeatREPL = true;
-
 	while (repeatREPL) {
 
+		/* Keep the prompt, which readline may leave in stdio's buffer, between our outputs */
+
+		lbuf_flush(&lval_stdout);
 		char* input = readline("lc> ");
+		fflush(stdout);
+
+		/* Leave at the end of input */
+
+		if (!input) {
+			lbuf_putc(&lval_stdout, '\n');
+			break;
+		}
+
 		add_history(input);
 
-		mpc_result_t r;
+		/* Read the line with the mpc grammar if asked, otherwise with the hand-written reader */
 
-		if (mpc_parse("<stdin>", input, Lispy, &r)) {
-			lval* x = lval_eval(e, lval_read(r.output));
-  			repeatREPL = ((x->type != LVAL_FUN) || (strcmp(x->sym, "quit") != 0));
-			if (repeatREPL) {
+		lval* x = NULL;
+
+		if (use_mpc) {
+			mpc_result_t r;
+			if (mpc_parse("<stdin>", input, Lispy, &r)) {
+				x = lval_read(r.output);
+				mpc_ast_delete(r.output);
+			} else {
+				mpc_err_print(r.error);
+				mpc_err_delete(r.error);
+				fflush(stdout);
+			}
+		} else {
+			lreader r;
+			lreader_init(&r, "<stdin>", input, strlen(input));
+			x = lread_all(&r);
+			if (ltype(x) == LVAL_ERR) {
 				lval_println(x);
 				lval_del(x);
+				x = NULL;
+			}
+		}
+
+		if (x) {
+			llim_reset();
+			x = lval_eval(e, x);
+  			repeatREPL = !lval_is_quit(x);
+			if (repeatREPL) {
+				lval_println(x);
+			}
+			lval_del(x);
+			if (repeatREPL) {
+				lgc_safepoint(e);
 			}
-			mpc_ast_delete(r.output);
-		} else {
-			mpc_err_print(r.error);
-			mpc_err_delete(r.error);
 		}
 		free(input);
 	}
 
-	/* Clean up and go home now that the hard work is done */
+	/* Report the profile, if any, then clean up and go home now that the hard work is done */
+
+	lbuf_free(&lval_stdout);
+	lprof_report();
 
 	lenv_del(e);
+	lpar_shutdown();
+	lsym_cleanup();
+	lpool_cleanup(&lval_pool);
+	lpool_cleanup(&lenv_pool);
 
-	mpc_cleanup(7, Number, Bool, Symbol, Sexpr, Qexpr, Expr, Lispy);
+	if (use_mpc) {
+		mpc_cleanup(7, Number, Bool, Symbol, Sexpr, Qexpr, Expr, Lispy);
+	}
+
+	return (failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+#endif
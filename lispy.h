@@ -0,0 +1,44 @@
+/* Embedding interface to the Lispy interpreter
+ *
+ * Build conditionals.c with LISPY_NO_MAIN defined and link it with mpc.c
+ * (make lib builds both into liblispy.a).
+ *
+ * Each instance has its own global environment, allocator pools and garbage
+ * collector.  An instance may be used by one thread at a time, and instances
+ * used from different threads need no locking between them.
+ */
+
+#ifndef lispy_h
+#define lispy_h
+
+typedef struct lispy lispy;
+
+/* Create an instance with the built-in functions defined */
+
+lispy* lispy_new(void);
+
+/* Evaluate each expression of a string in turn, returning the printed value of
+ * the last one, or of the syntax error that stopped it, in a string the caller
+ * frees.  Returns NULL once the string has evaluated 'quit'.
+ */
+
+char* lispy_eval_string(lispy* l, const char* src);
+
+/* Limit the calls made by each top level expression, how deeply they may nest
+ * and the bytes the instance may hold allocated, with 0 leaving one unlimited.
+ * An expression going over a limit evaluates to an error.
+ */
+
+void lispy_limit(lispy* l, long steps, long depth, long bytes);
+
+/* Read the calls made and the deepest nesting reached by the last top level
+ * expression evaluated, and the bytes the instance now holds allocated.
+ */
+
+void lispy_usage(lispy* l, long* steps, long* depth, long* bytes);
+
+/* Free an instance and everything it allocated */
+
+void lispy_free(lispy* l);
+
+#endif
@@ -0,0 +1,45 @@
+#!/bin/bash
+
+#Check that faulting constant expressions are left to run time when folding
+#
+#    tests/fold.sh [interpreter]
+#
+#Constant calls in lambda bodies are evaluated when the lambda is defined, so
+#a fault in a branch never taken must neither stop the definition nor appear.
+
+LISPY=$(realpath "${1:-./conditionals.exe}")
+
+if [ ! -x "$LISPY" ]; then
+	echo "Interpreter '$LISPY' not found, build it first" >&2
+	exit 1
+fi
+
+#check name definition-and-calls expected-output
+
+status=0
+
+check() {
+	result=$(printf '%s\n' "$2" | "$LISPY" 2>&1)
+	if [ "$result" != "$3" ]; then
+		printf '%s failed, got:\n%s\n' $1 "$result" >&2
+		status=1
+	fi
+}
+
+check div-zero \
+	'(def {f} (\ {x} {if x {/ 1 0} {0}})) (f 0) (f 1)' \
+	$'()\n0\nError: Division by zero!'
+check mod-zero \
+	'(def {f} (\ {x} {if x {% 1 0} {0}})) (f 0) (f 1)' \
+	$'()\n0\nError: Modulo by zero!'
+check div-overflow \
+	'(def {f} (\ {x} {if x {/ -9223372036854775808 -1} {0}})) (f 0) (f 1)' \
+	$'()\n0\nError: Integer overflow!'
+check mod-overflow \
+	'(def {f} (\ {x} {if x {% -9223372036854775808 -1} {0}})) (f 0) (f 1)' \
+	$'()\n0\nError: Integer overflow!'
+check folded \
+	'(def {f} (\ {x} {if x {% 7 (- 5 1)} {0}})) (f 1)' \
+	$'()\n3'
+
+exit $status
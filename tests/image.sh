@@ -0,0 +1,54 @@
+#!/bin/bash
+
+#Check that malformed images are rejected without defining anything
+#
+#    tests/image.sh [interpreter]
+#
+#Each image defines p as a partial application of (\ {a b c} {+ a b c}) to
+#1 and 2, written out byte by byte in the format described in conditionals.c.
+
+LISPY=$(realpath "${1:-./conditionals.exe}")
+
+if [ ! -x "$LISPY" ]; then
+	echo "Interpreter '$LISPY' not found, build it first" >&2
+	exit 1
+fi
+
+#Image file names are symbols, so work in a directory of our own
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR"
+
+#image name bound-arguments
+
+image() {
+	printf 'LSPYIMG\001\001\000\001pL'                   > $1
+	printf '{\003S\001\001aS\002\001bS\003\001c'        >> $1
+	printf '{\004S\004\001+S\001S\002S\003'             >> $1
+	printf '\002\000'"$2"'\000'                         >> $1
+}
+
+#check name expected-output
+
+status=0
+
+check() {
+	result=$(printf '(load-image {%s})\n(p 3)\n' $1 | "$LISPY" 2>&1)
+	if [ "$result" != "$2" ]; then
+		printf '%s failed, got:\n%s\n' $1 "$result" >&2
+		status=1
+	fi
+}
+
+image good    '\001N\002\001N\004\000'
+image absent  '\000\001N\004\000'
+image extra   '\001N\002\001N\004\001N\006'
+image short   '\001N\002\001N'
+
+check good   $'()\n6'
+check absent $'Error: Image \'absent\' is corrupt\nError: unbound symbol \'p\'!'
+check extra  $'Error: Image \'extra\' is corrupt\nError: unbound symbol \'p\'!'
+check short  $'Error: Image \'short\' is corrupt\nError: unbound symbol \'p\'!'
+
+exit $status
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+#Check that memoized functions tell their arguments apart
+#
+#    tests/memo.sh [interpreter]
+#
+#Arguments are compared structurally, so partial applications of the same
+#lambda must differ by the values they have bound.
+
+LISPY=$(realpath "${1:-./conditionals.exe}")
+
+if [ ! -x "$LISPY" ]; then
+	echo "Interpreter '$LISPY' not found, build it first" >&2
+	exit 1
+fi
+
+#check name definitions-and-calls expected-output
+
+status=0
+
+check() {
+	result=$(printf '%s\n' "$2" | "$LISPY" 2>&1)
+	if [ "$result" != "$3" ]; then
+		printf '%s failed, got:\n%s\n' $1 "$result" >&2
+		status=1
+	fi
+}
+
+DEFS='(def {g} (\ {x y} {+ x y})) (def {ap} (memo (\ {f} {f 0})))'
+
+check partial \
+	"$DEFS"' (ap (g 1)) (ap (g 2)) (ap (g 1)) (memo-stats ap)' \
+	$'()\n()\n1\n2\n1\n{1 2 2 4096}'
+check lambda \
+	"$DEFS"' (ap (\ {y} {+ 1 y})) (ap (\ {y} {+ 2 y})) (ap (\ {y} {+ 1 y})) (memo-stats ap)' \
+	$'()\n()\n1\n2\n1\n{1 2 2 4096}'
+
+exit $status